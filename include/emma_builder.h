@@ -0,0 +1,141 @@
+// emma_builder.h
+//
+// Timestamp event builder for the EMMA TDC (V1190) and ADC (MADC32)
+//
+// A MIDAS event may contain any number of TDC and ADC events. They are
+// queued as fragments, sorted by time, and paired by time stamp: the
+// V1190 extended trigger time tag (27 bits) and the MADC32 time stamp
+// (30 bits) are unwrapped and converted to microseconds. The two clocks
+// have different zeros, the offset between them is taken from the first
+// pair and follows every matched pair after that.
+//
+// A TDC and an ADC fragment match if their times are within the
+// coincidence window. A fragment without partner is dropped when the
+// other queue has moved past it by more than the reorder depth, or at
+// the end of the run. Matched pairs are returned as EmmaBuiltEvent flow
+// events.
+//
+
+#ifndef EMMA_BUILDER_H
+#define EMMA_BUILDER_H
+
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+#include "manalyzer.h"
+#include "mesadc32unpack.h"
+
+class v1190event;
+class EmmaTdcHits;
+
+// ADC event with its own copy of the hits
+
+struct EmmaAdcFragment
+{
+   mesadc32result fResult; // hit pointers are set by GetResult()
+   mesadc32buffer fHits;
+
+   void Set(const mesadc32result* r); // copy the event and its hits
+   const mesadc32result* GetResult(); // the event, pointing to fHits
+};
+
+// flow event with one TDC and one ADC event from the same trigger
+
+class EmmaBuiltEvent: public TAFlowEvent
+{
+public:
+   v1190event* fTdc; // owned
+   EmmaTdcHits* fTdcHits; // owned, fTdc reduced by EmmaModule::Unpack()
+   EmmaAdcFragment fAdc;
+   double fTdcTime; // unwrapped, usec
+   double fAdcTime; // unwrapped, usec, ADC clock
+
+public:
+   EmmaBuiltEvent(TAFlowEvent* flow); // ctor
+   ~EmmaBuiltEvent(); // dtor, deletes the TDC event and its hits
+};
+
+// flow event with the TDC and ADC events unpacked from one MIDAS event,
+// made by EmmaModule::AnalyzeParallel(), given to the event builder by
+// EmmaModule::Analyze()
+
+class EmmaUnpackedEvent: public TAFlowEvent
+{
+public:
+   std::vector<v1190event*> fTdc; // owned, NULL after AddTdc()
+   std::vector<EmmaTdcHits*> fTdcHits; // owned, NULL after AddTdc(), one per fTdc
+   std::vector<EmmaAdcFragment> fAdc;
+
+public:
+   EmmaUnpackedEvent(TAFlowEvent* flow); // ctor
+   ~EmmaUnpackedEvent(); // dtor, deletes the TDC events and their hits
+};
+
+class EmmaEventBuilder
+{
+public:
+   double fWindowUs = 10.0; // coincidence window, usec
+   unsigned fDepth = 16; // reorder depth, fragments per queue
+   double fTdcTickUs = 0.8; // V1190 extended trigger time tag, 800 ns
+   double fAdcTickUs = 1.0; // MADC32 time stamp, external 1 MHz clock
+
+   int fNumTdc = 0; // fragments added
+   int fNumAdc = 0;
+   int fNumBuilt = 0; // matched pairs
+   int fNumTdcDropped = 0; // fragments without partner
+   int fNumAdcDropped = 0;
+
+public:
+   EmmaEventBuilder(); // ctor
+   ~EmmaEventBuilder(); // dtor, deletes the queued fragments
+
+   void AddTdc(v1190event* te, EmmaTdcHits* hits); // takes ownership of the event and its hits
+   void AddAdc(const mesadc32result* ae); // copies the event
+
+   // return the matched events chained to "flow", in time order from the end
+   // of the chain. With "flush", drop all unmatched fragments.
+   TAFlowEvent* Build(TAFlowEvent* flow, bool flush);
+
+   void Print() const; // statistics
+
+private:
+   struct Fragment
+   {
+      double fTime; // usec
+      v1190event* fTdc;
+      EmmaTdcHits* fTdcHits;
+      EmmaAdcFragment* fAdc;
+   };
+
+   static void Insert(std::deque<Fragment>* q, const Fragment& f); // keep the queue sorted by time
+   void DropTdc();
+   void DropAdc();
+
+   std::deque<Fragment> fTdcQueue;
+   std::deque<Fragment> fAdcQueue;
+
+   // rollover of the raw time stamps
+   uint32_t fLastTdcRaw = 0;
+   uint32_t fLastAdcRaw = 0;
+   double fTdcWraps = 0;
+   double fAdcWraps = 0;
+
+   bool fHaveOffset = false;
+   double fOffset = 0; // ADC time minus TDC time, usec
+   unsigned fNumDroppedInRow = 0; // fragments dropped since the last match
+
+private:
+   EmmaEventBuilder(const EmmaEventBuilder&); // not copyable
+   EmmaEventBuilder& operator=(const EmmaEventBuilder&);
+};
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,105 @@
+// emma_calib.h
+//
+// Channel map and calibration of the EMMA detectors
+//
+// Every value has a default (the EMMA wiring), values found in the ODB
+// under /Analyzer/EMMA override them, values in the calibration file
+// (module argument --calib=<file>) override both. The file has one
+// "name value" pair per line, # starts a comment, the names are the same
+// as in the ODB:
+//
+//   tdc_at 0        # TDC channel of the anode top
+//   xl_offset 40    # cable delay of XL, TDC counts
+//   si_gate_min 800
+//
+// Compile() makes the channel to role lookup tables used per hit.
+//
+
+#ifndef EMMA_CALIB_H
+#define EMMA_CALIB_H
+
+#include <stdint.h>
+#include <vector>
+
+class VirtualOdb;
+
+#define EMMA_TDC_CHANNELS 64
+#define EMMA_ADC_CHANNELS 32 // at most 32, see EmmaScratch::fAdcTouched
+
+#define EMMA_CALIB_ODB "/Analyzer/EMMA"
+
+// TDC roles
+
+#define EMMA_TDC_AT     0 // anode top
+#define EMMA_TDC_AM     1 // anode middle
+#define EMMA_TDC_AB     2 // anode bottom
+#define EMMA_TDC_XR     3 // cathode x right
+#define EMMA_TDC_XL     4 // cathode x left
+#define EMMA_TDC_YT     5 // cathode y top
+#define EMMA_TDC_YB     6 // cathode y bottom
+#define EMMA_TDC_TRIG   7 // trigger
+#define EMMA_TDC_RF     8 // accelerator RF
+#define EMMA_TDC_NROLES 9
+
+// ADC roles, same order as the hADC_used histograms
+
+#define EMMA_ADC_AT     0 // anode top energy
+#define EMMA_ADC_AM     1 // anode middle energy
+#define EMMA_ADC_AB     2 // anode bottom energy
+#define EMMA_ADC_SI     3 // silicon energy
+#define EMMA_ADC_SBL    4 // surface barrier left
+#define EMMA_ADC_SBR    5 // surface barrier right
+#define EMMA_ADC_NROLES 6
+
+class EmmaCalib
+{
+public:
+   int fTdcChannel[EMMA_TDC_NROLES]; // channel of each role
+   int fAdcChannel[EMMA_ADC_NROLES];
+   int fTdcTrigSignal; // channel of the TDC trigger signal histogram, -1: 7 before run 202, 28 after
+
+   double fXlOffset; // cable delays, TDC counts
+   double fXrOffset;
+   double fYbOffset;
+   double fYtOffset;
+   double fXScale; // position = scale*difference/sum
+   double fYScale;
+   double fXDiffScale; // x_y_diff histograms
+   double fYDiffScale;
+   double fGatedDiffScale; // x_y_diff_Gated histograms
+   double fSiGateMin; // silicon energy gate
+   double fSiGateMax;
+
+   // made by Compile()
+   int8_t fTdcRole[EMMA_TDC_CHANNELS]; // role of each channel, -1 if unused
+   int8_t fAdcRole[EMMA_ADC_CHANNELS];
+   int fTdcTrigChannel; // fTdcTrigSignal for this run
+
+public:
+   EmmaCalib(); // ctor, defaults
+   void SetDefaults();
+   void ReadOdb(VirtualOdb* odb, const char* path); // only the values found in the ODB
+   bool ReadFile(const char* filename); // false if the file cannot be read or has errors
+   bool Compile(int runno); // false if a channel is out of range or has two roles
+   void Print() const;
+
+private:
+   struct Key
+   {
+      const char* fName;
+      int* fInt;
+      double* fDouble;
+   };
+
+   std::vector<Key> Keys();
+};
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
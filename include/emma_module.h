@@ -12,10 +12,15 @@
 #include "TCanvas.h"
 #include "TH1D.h"
 #include "TH2D.h"
+#include "tahist.h"
 #include "TProfile.h"
 #include "TMath.h"
 #include "TTree.h"
 #include "TBranch.h"
+#include "emma_output.h"
+#include "emma_builder.h"
+#include "emma_calib.h"
+#include "emma_tdc.h"
 
 #include "v1190unpack.h"
 #include "mesadc32unpack.h"
@@ -26,8 +31,57 @@
 struct EmmaConfig {
    bool fVerboseV1190 = false;
    bool fVerboseMesadc32 = false;
+   bool fStrictMesadc32 = false; // check every ADC word, report problems
+   std::string fOutputType = "tree"; // "tree" or "columnar"
+   int fOutputCompression = EMMACOL_COMPRESS_NONE; // columnar output only
+   int fOutputBlockEvents = 65536; // columnar output only
+   double fBuildWindowUs = 10.0; // ADC/TDC coincidence window of the event builder
+   int fBuildDepth = 16; // reorder depth of the event builder
+   double fAdcTickUs = 1.0; // MADC32 time stamp clock period
+   std::string fCalibFile; // channel map and calibration, see emma_calib.h
 }; // end EmmaConfig
 
+// time since the previous event, part of the state of one run
+
+class EmmaTimeTracker {
+public:
+   void Reset() { fHavePrev = false; fPrev = 0; }
+
+   double Delta(double t) // 0 for the first event
+   {
+      double dt = fHavePrev ? t - fPrev : 0;
+      fPrev = t;
+      fHavePrev = true;
+      return dt;
+   }
+
+private:
+   bool fHavePrev = false;
+   double fPrev = 0;
+}; // end EmmaTimeTracker
+
+// per-event ADC scratch of UpdateHistograms(), made once per module.
+// Reset() clears only the channels used by the previous event.
+
+struct alignas(64) EmmaScratch {
+   double fEnergy[EMMA_ADC_CHANNELS]; // energy of the used ADC channels, 0 without hit
+   uint32_t fAdcTouched; // bit mask of the channels to clear in Reset()
+
+   static EmmaScratch* New(); // cache line aligned, cleared
+   static void Delete(EmmaScratch* s);
+
+   void Reset();
+
+   bool SetEnergy(int chan, double e) // false if the channel is out of range
+   {
+      if (chan < 0 || chan >= EMMA_ADC_CHANNELS)
+         return false;
+      fAdcTouched |= 1u<<chan;
+      fEnergy[chan] = e;
+      return true;
+   }
+}; // end EmmaScratch
+
 class EmmaModule: public TARunObject {
 public:
    EmmaConfig* fConfig = NULL;
@@ -38,51 +92,57 @@ public:
    ~EmmaModule();
    void ResetHistograms();
    void PlotHistograms(TARunInfo* runinfo);
-   void UpdateHistograms(TARunInfo* runinfo, const v1190event* tdc_data, const mesadc32event* adc_data);
+   void RefreshDisplay(TARunInfo* runinfo) { PlotHistograms(runinfo); }
+   void UpdateHistograms(TARunInfo* runinfo, const EmmaTdcSummary* tdc, const mesadc32result* adc_data, double adc_time);
    void BeginRun(TARunInfo* runinfo);
    void EndRun(TARunInfo* runinfo);
    void PauseRun(TARunInfo* runinfo) { printf("PauseRun, run %d\n", runinfo->fRunNo); }
    void ResumeRun(TARunInfo* runinfo) { printf("ResumeRun, run %d\n", runinfo->fRunNo); }
+   TAFlowEvent* AnalyzeParallel(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow);
    TAFlowEvent* Analyze(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow);
+   TAFlowEvent* AnalyzeView(TARunInfo* runinfo, const TMEventView* event, TAFlags* flags, TAFlowEvent* flow);
+   EmmaUnpackedEvent* Unpack(const char* tdc_ptr, int tdc_len, const char* adc_ptr, int adc_len, TAFlowEvent* flow) const; // thread safe
+   TAFlowEvent* AnalyzeBanks(TARunInfo* runinfo, int serial_number, EmmaUnpackedEvent* ue, TAFlowEvent* flow);
+   TAFlowEvent* AnalyzeFlowEvent(TARunInfo* runinfo, TAFlags* flags, TAFlowEvent* flow);
+   void PreEndRun(TARunInfo* runinfo, std::deque<TAFlowEvent*>* flow_queue);
    void AnalyzeSpecialEvent(TARunInfo* runinfo, TMEvent* event);
 
 public:
    // EMMA things go below here:
-   int ct;
-   int ach[6] = {0, 1, 2, 16, 18, 20};
-
-   TH1D *fHTdcTrig;
-   TH1D *fHTdcRaw[64];
-   TH1D *fHAdcRaw[32];
-   TH1D *hSienergy;
-   TH1D *hADC_used[6];
+   EmmaCalib fCalib; // channel map and calibration, loaded in BeginRun()
+
+   TAH1D fHTdcTrig;
+   TAH1I fHTdcRaw[64];
+   TAH1I fHAdcRaw[32];
+   TAH1D hSienergy;
+   TAH1D hADC_used[6];
    TH1D *hATenergy;
    TH1D *hAMenergy;
    TH1D *hABenergy;
    TH1D *hPGACenergy;
-   TH2D *hdE_E;
-   TH1D *x_y_diff[2];
-   TH1D *x_y_diff_Gated[2];
-   TH1D *x_y_sum[2];
+   TAH2D hdE_E;
+   TAH1D x_y_diff[2];
+   TAH1D x_y_diff_Gated[2];
+   TAH1D x_y_sum[2];
    TH2D *x_y_diff_vs_sum[2];
-   TH1D *hXPosition;
-   TH1D *hXPosition_Gated;
-   TH1D *hYPosition;
-   TH1D *hYPosition_Gated;
-   TH2D *hXYPosition;
-   TH2D *hXYPosition_Gated;
-   TH1D *hRF;
-   TH1D *hsbl;
-   TH1D *hsbr;
-
-   TH1D *hmulti_at;
-   TH1D *hmulti_am;
-   TH1D *hmulti_ab;
-   TH1D *hmulti_xr;
-   TH1D *hmulti_xl;
-   TH1D *hmulti_yt;
-   TH1D *hmulti_yb;
-   TH1D *hmulti_trig;
+   TAH1D hXPosition;
+   TAH1D hXPosition_Gated;
+   TAH1D hYPosition;
+   TAH1D hYPosition_Gated;
+   TAH2D hXYPosition;
+   TAH2D hXYPosition_Gated;
+   TAH1D hRF;
+   TAH1D hsbl;
+   TAH1D hsbr;
+
+   TAH1D hmulti_at;
+   TAH1D hmulti_am;
+   TAH1D hmulti_ab;
+   TAH1D hmulti_xr;
+   TAH1D hmulti_xl;
+   TAH1D hmulti_yt;
+   TAH1D hmulti_yb;
+   TAH1D hmulti_trig;
 
    TCanvas* fCanvasTdcRaw;
    TCanvas* fCanvasTdcUsed;
@@ -104,15 +164,15 @@ public:
    TCanvas* fCanvasRF;
    TCanvas* fCanvasSSB;
 
-   TH1D*    fHTdcNhits = NULL;
-   TH1D*    fHAdcNhits = NULL;
-   TH1D*    fHAdcTime0 = NULL;
-   TH1D*    fHTdcTime0 = NULL;
-   TH1D*    fHAdcTime1 = NULL;
-   TH1D*    fHTdcTime1 = NULL;
-   TH1D*    fHAdcTime2 = NULL;
-   TH1D*    fHTdcTime2 = NULL;
-   TH1D*    fHAdcTdcTime = NULL;
+   TAH1D    fHTdcNhits;
+   TAH1D    fHAdcNhits;
+   TAH1D    fHAdcTime0;
+   TAH1D    fHTdcTime0;
+   TAH1D    fHAdcTime1;
+   TAH1D    fHTdcTime1;
+   TAH1D    fHAdcTime2;
+   TAH1D    fHTdcTime2;
+   TAH1D    fHAdcTdcTime;
 
    Double_t at;
    Double_t am;
@@ -142,7 +202,14 @@ public:
    Int_t multi_yb;
    Int_t multi_trig;
 
-   TTree *t1;
+   EmmaOutput* fOutput; // per-event summary, made in BeginRun()
+
+   EmmaEventBuilder fBuilder; // pairs the TDC and ADC events
+   EmmaTimeTracker fTdcDelta; // built events, unwrapped TDC time, usec
+   EmmaTimeTracker fAdcDelta; // built events, unwrapped ADC time
+   EmmaTimeTracker fEtttDelta; // all TDC events, for the debug messages
+   EmmaScratch* fScratch; // per-event scratch of UpdateHistograms()
+   Mesadc32DecodeFunc fDecodeAdc; // selected from EmmaConfig
 
 }; // end EmmaModule
 
@@ -154,6 +221,7 @@ public:
 public:
    void Finish() { printf("Finish!\n"); }
    void Init(const std::vector<std::string> &args);
+   int MergeParallel(const char* part);
    TARunObject* NewRunObject(TARunInfo* runinfo);
 }; // end EmmaModuleFactory
 
@@ -0,0 +1,173 @@
+// emma_output.h
+//
+// Per-event summary output of the EMMA module
+//
+// EmmaOutput is the output backend, selected by the module argument
+// --output=tree (default) or --output=columnar:
+//
+// EmmaTreeOutput writes the ROOT TTree "t1" into the ROOT output file,
+// one Double_t branch per variable, as before.
+//
+// EmmaColumnarOutput writes a compact binary file, emma%05d.ecol: a fixed
+// set of columns (float32 times and energies, int16 multiplicities) in
+// blocks of many events, optionally compressed with LZ4 or zstd. All
+// integers are little-endian, all offsets are multiples of 8:
+//
+//   file header:   char magic[8] = "EMMACOL1", uint32 version, uint32 ncolumns,
+//                  uint32 run number, uint32 zero
+//   ncolumns x:    char name[24], uint32 type (EMMACOL_FLOAT32, ...), uint32 size in bytes
+//   blocks to EOF: char magic[4] = "EBLK", uint32 compression (EMMACOL_COMPRESS_NONE, ...),
+//                  uint32 number of events, uint32 zero, uint64 data size, uint64 stored size,
+//                  then the stored data, padded to a multiple of 8
+//
+// The block data holds the columns one after another, each padded to a
+// multiple of 8 bytes. Uncompressed blocks can be used directly from an
+// mmap()ed file, EmmaColumnarReader does that.
+//
+// With -j every worker writes emma%05d.part<tag>-<index>.ecol, at the end
+// EmmaModuleFactory::MergeParallel() concatenates the blocks of the parts
+// of each run into emma%05d.ecol, in file order.
+//
+
+#ifndef EMMA_OUTPUT_H
+#define EMMA_OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "TTree.h"
+
+#define EMMACOL_FLOAT32 1
+#define EMMACOL_INT16   2
+
+#define EMMACOL_COMPRESS_NONE 0
+#define EMMACOL_COMPRESS_LZ4  1
+#define EMMACOL_COMPRESS_ZSTD 2
+
+// variables saved for every event
+
+struct EmmaSummary
+{
+   double at = 0;
+   double am = 0;
+   double ab = 0;
+   double anode = 0;
+   double xl = 0;
+   double xr = 0;
+   double yb = 0;
+   double yt = 0;
+   double trig = 0;
+   double ATenergy = 0;
+   double AMenergy = 0;
+   double ABenergy = 0;
+   double PGACenergy = 0;
+   double Sienergy = 0;
+   double trf = 0;
+   double trf_next = 0;
+   double sbr_ene = 0;
+   double sbl_ene = 0;
+
+   int multi_at = 0; // not in the TTree
+   int multi_am = 0;
+   int multi_ab = 0;
+   int multi_xr = 0;
+   int multi_xl = 0;
+   int multi_yt = 0;
+   int multi_yb = 0;
+   int multi_trig = 0;
+};
+
+class EmmaOutput
+{
+public:
+   virtual ~EmmaOutput() {} // dtor
+   virtual void Fill(const EmmaSummary* s) = 0;
+   virtual void Close() {} // end of run, write out everything
+
+   static int ParseCompression(const char* s); // "none", "lz4" or "zstd", -1 if invalid or not compiled in
+};
+
+class EmmaTreeOutput: public EmmaOutput
+{
+public:
+   EmmaTreeOutput(); // ctor, makes the tree in the current ROOT directory
+   void Fill(const EmmaSummary* s);
+
+private:
+   TTree* fTree; // owned by the ROOT output file
+   EmmaSummary fData; // the branches point here
+};
+
+class EmmaColumnarOutput: public EmmaOutput
+{
+public:
+   EmmaColumnarOutput(const char* filename, int runno, int compression, int block_events); // ctor
+   ~EmmaColumnarOutput(); // dtor, calls Close()
+   void Fill(const EmmaSummary* s);
+   void Close();
+
+   static bool Concatenate(const char* filename, const std::vector<std::string>& parts); // one file with the blocks of all parts, in order, the parts must have the same header
+
+private:
+   void WriteBlock();
+   void Write(const void* ptr, size_t size);
+
+   std::string fFilename;
+   FILE* fFile;
+   bool fError;
+   int fCompression;
+   int fBlockEvents; // events per block
+   int fNevents; // events in the current block
+   std::vector<std::vector<char>> fColumns; // current block
+   std::vector<char> fData; // block data
+   std::vector<char> fPacked; // compressed block data
+};
+
+// reads the files written by EmmaColumnarOutput
+
+class EmmaColumnarReader
+{
+public:
+   struct Column
+   {
+      std::string fName;
+      int fType;
+      int fSize;
+   };
+
+   std::string fFilename;
+   bool fError;
+   std::string fErrorString;
+   int fRunNo;
+   std::vector<Column> fColumns;
+
+public:
+   EmmaColumnarReader(const char* filename); // ctor, maps the file and reads the header
+   ~EmmaColumnarReader(); // dtor, unmaps the file
+
+   int FindColumn(const char* name) const; // -1 if not found
+   bool NextBlock(); // false at EOF or on error
+   int GetNevents() const { return fNevents; } // events in the current block
+   const void* GetColumn(int i) const { return fColumnData[i]; } // column data of the current block
+
+private:
+   const char* fMap;
+   size_t fSize;
+   size_t fPos; // offset of the next block
+   int fNevents;
+   std::vector<const void*> fColumnData;
+   std::vector<char> fUnpacked; // decompressed block data
+};
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
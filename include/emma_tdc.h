@@ -0,0 +1,92 @@
+// emma_tdc.h
+//
+// Per-event summary of the EMMA TDC hits
+//
+// EmmaTdcHits::Reduce() looks at every TDC hit once and keeps what the
+// analysis uses: the leading edges (channel and time, for the raw
+// spectra, all hits of a channel are there), the earliest time and the
+// multiplicity of each channel, the RF hits and the trigger signal.
+// Trailing edges are skipped. It only needs the TDC event and the
+// calibration, so EmmaModule::Unpack() does it on the worker threads, the
+// result goes through the event builder with its TDC event. New() and
+// Delete() recycle the objects and the memory of their vectors.
+//
+// EmmaModule adds one EmmaTdcSummary per built event to the flow, ahead
+// of the EmmaBuiltEvent it was made from, other modules can use it
+// instead of scanning the raw hits again.
+//
+
+#ifndef EMMA_TDC_H
+#define EMMA_TDC_H
+
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+#include "manalyzer.h"
+#include "emma_calib.h"
+
+class v1190event;
+class EmmaBuiltEvent;
+
+#define EMMA_TDC_RF_HITS 16 // RF hit times kept
+#define EMMA_NO_TIME     999999.0 // channel without hits
+
+class EmmaTdcHits
+{
+public:
+   int fTrigSignal; // first leading edge on the trigger signal channel, 0 without
+   int fNumIgnored; // leading edges on channels out of range
+
+   std::vector<uint8_t> fLeadChannel; // all leading edges, in readout order
+   std::vector<int> fLeadTime;
+
+   double fEarliest[EMMA_TDC_CHANNELS]; // EMMA_NO_TIME without hits
+   int fCounts[EMMA_TDC_CHANNELS];
+
+   int fNumRf; // all RF hits, fRf has the first EMMA_TDC_RF_HITS
+   double fRf[EMMA_TDC_RF_HITS];
+
+public:
+   static EmmaTdcHits* New(); // reset, from the free list if possible, thread safe
+   static void Delete(EmmaTdcHits* h); // back to the free list, thread safe
+
+   void Reset();
+   void Reduce(const v1190event* tdc, const EmmaCalib* calib); // fill from the TDC hits, thread safe
+
+   double Earliest(const EmmaCalib* calib, int role) const { return fEarliest[calib->fTdcChannel[role]]; }
+   int Count(const EmmaCalib* calib, int role) const { return fCounts[calib->fTdcChannel[role]]; }
+
+private:
+   EmmaTdcHits(); // ctor, use New()
+
+   struct FreeList
+   {
+      std::mutex fMutex;
+      std::vector<EmmaTdcHits*> fHits;
+      ~FreeList(); // dtor, deletes the recycled objects at exit
+   };
+
+   static FreeList fgFree;
+};
+
+class EmmaTdcSummary: public TAFlowEvent
+{
+public:
+   const EmmaBuiltEvent* fEvent; // the built event, further down the same flow
+   const EmmaTdcHits* fHits; // owned by fEvent
+   double fTdcTime; // unwrapped event time, usec
+
+public:
+   EmmaTdcSummary(TAFlowEvent* flow); // ctor
+};
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -11,17 +11,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <signal.h>
 #include <string>
 #include <vector>
 #include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "manalyzer.h"
 #include "midasio.h"
 #include "rootana_config.h"
 #include "midasio.h"
+#include "midasmmap.h"
+#include "midasindex.h"
+#include "talog.h"
 #include "VirtualOdb.h"
 
 #ifdef HAVE_MIDAS
@@ -30,6 +38,7 @@
 
 #ifdef HAVE_ROOT
 #include "TSystem.h"
+#include "TROOT.h"
 #include <TGMenu.h>
 #include <TGButton.h>
 #include <TBrowser.h>
@@ -78,6 +87,63 @@ private:
    TARunInfo() {}; // hidden default constructor
 };
 
+/// Flow events: data passed between modules, chained through fNext,
+/// newest first. Deleting the newest event deletes the whole chain.
+///
+/// Flow events made while an event is analyzed are allocated in the
+/// per-event arena (TAArena::GetCurrent()), all of them are released at
+/// once when the arena is reset after the event, their destructors still
+/// run. Such flow events must not be kept after the event. Outside of
+/// event analysis (i.e. PreEndRun()) they come from the heap as before.
+///
+/// Find<T>() returns the newest event of type T (or derived from T) in the
+/// chain. The answer is cached per chain and per type (type IDs from
+/// TAFlowTypeId), repeated Find<T>() only look at the events added since
+/// the previous one.
+
+class TAFlowEvent;
+
+class TAFlowTypeId
+{
+public:
+   template<class T> static int Get() { static const int id = Next(); return id; } // small integer, unique per type
+
+private:
+   static int Next();
+};
+
+#define TAFLOW_MAX_TYPES 16 // types cached per chain, Find<T>() of other types walks the chain
+
+struct TAFlowRegistry
+{
+   struct Entry
+   {
+      int fType; // TAFlowTypeId
+      uint32_t fHeadSeq; // fSeq of fHead
+      const TAFlowEvent* fHead; // event the last search started from
+      void* fFound; // T* found from fHead, NULL if none
+   };
+
+   uint32_t fNextSeq; // sequence number of the next event in the chain
+   int fNumEntries;
+   Entry fEntries[TAFLOW_MAX_TYPES];
+
+   Entry* Get(int type) // NULL if the cache is full
+   {
+      for (int i=0; i<fNumEntries; i++)
+         if (fEntries[i].fType == type)
+            return &fEntries[i];
+      if (fNumEntries >= TAFLOW_MAX_TYPES)
+         return NULL;
+      Entry* e = &fEntries[fNumEntries++];
+      e->fType = type;
+      e->fHeadSeq = 0;
+      e->fHead = NULL;
+      e->fFound = NULL;
+      return e;
+   }
+};
+
 class TAFlowEvent
 {
 public:
@@ -89,15 +155,44 @@ public:
 
    template<class T> T* Find()
    {
+      TAFlowRegistry::Entry* e = fRegistry ? fRegistry->Get(TAFlowTypeId::Get<T>()) : NULL;
+
+      if (e && e->fHead == this && e->fHeadSeq == fSeq)
+         return (T*)e->fFound;
+
+      T* ptr = NULL;
       TAFlowEvent* f = this;
       while (f) {
-         T *ptr = dynamic_cast<T*>(f);
-         if (ptr) return ptr;
+         if (e && f == e->fHead && f->fSeq == e->fHeadSeq) { // searched before, nothing newer matched
+            ptr = (T*)e->fFound;
+            break;
+         }
+         ptr = dynamic_cast<T*>(f);
+         if (ptr)
+            break;
          f = f->fNext;
       }
-      return NULL;
+
+      if (e) {
+         e->fHead = this;
+         e->fHeadSeq = fSeq;
+         e->fFound = ptr;
+      }
+
+      return ptr;
    }
 
+   static void* operator new(size_t size); // from TAArena::GetCurrent() if set
+   static void operator delete(void* ptr);
+
+   static void* Alloc(size_t size); // same, for the registry
+   static void Free(void* ptr);
+
+private:
+   TAFlowRegistry* fRegistry; // shared by the chain
+   uint32_t fSeq; // order in the chain, newer events have larger numbers
+   bool fOwnRegistry; // the oldest event deletes the registry
+
 private:
    TAFlowEvent() {}; // hidden default constructor
 };
@@ -112,6 +207,11 @@ typedef int TAFlags;
 
 class TARunObject
 {
+public:
+   bool fEventView; // module implements AnalyzeView()
+   bool fParallel; // module implements AnalyzeParallel()
+   bool fBatch; // module implements AnalyzeBatch()
+
 public:
    TARunObject(TARunInfo* runinfo); // ctor
    virtual ~TARunObject() {}; // dtor
@@ -127,9 +227,14 @@ public:
    virtual void PreEndRun(TARunInfo* runinfo, std::deque<TAFlowEvent*>* flow_queue); // generate flow events before end of run
 
    virtual TAFlowEvent* Analyze(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow);
+   virtual TAFlowEvent* AnalyzeView(TARunInfo* runinfo, const TMEventView* event, TAFlags* flags, TAFlowEvent* flow); // zero-copy Analyze(), used if fEventView is set
    virtual TAFlowEvent* AnalyzeFlowEvent(TARunInfo* runinfo, TAFlags* flags, TAFlowEvent* flow);
+   virtual TAFlowEvent* AnalyzeParallel(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow); // part of Analyze() that uses only this event, may run on a worker thread, see TAWorkPool
+   virtual void AnalyzeBatch(TARunInfo* runinfo, TMEvent** events, int n, TAFlags* flags, TAFlowEvent** flows); // Analyze() of a block of events, used if fBatch is set, see RunHandler::AnalyzeBatch()
    virtual void AnalyzeSpecialEvent(TARunInfo* runinfo, TMEvent* event);
 
+   virtual void RefreshDisplay(TARunInfo* runinfo); // redraw canvases, called from the main thread between events, see RunHandler::RefreshDisplay()
+
 private:
    TARunObject(); // hidden default constructor
 };
@@ -146,6 +251,7 @@ public:
 public:
    virtual void Init(const std::vector<std::string> &args); // start of analysis
    virtual void Finish(); // end of analysis
+   virtual int MergeParallel(const char* part); // -j: merge the worker output files with "part" in their name, returns the number of errors
 };
 
 template<class T> class TAFactoryTemplate: public TAFactory
@@ -170,6 +276,7 @@ public:
 #include "TFile.h"
 #include "TDirectory.h"
 #include "TApplication.h"
+#include "tahist.h"
 
 class XmlServer;
 class THttpServer;
@@ -178,6 +285,8 @@ class TARootHelper
 {
 public:
    TFile* fOutputFile;
+   static std::string   fgOutputFileFormat; // output file name, printf() format of the run number
+   static std::string   fgOutputPart; // -j: ".part<tag>-<index>" of this worker, to be added to the names of other output files
    static TDirectory*   fgDir;
    static TApplication* fgApp;
    static XmlServer*    fgXmlServer;
@@ -208,6 +317,405 @@ public:
    const char* odbReadString(const char*name, int index = 0,const char* defaultValue = NULL) { return defaultValue; }
 };
 
+// ==================== Class TATimeStats ==================== //
+
+/// Wall time statistics of one analysis stage (--timing): number of calls,
+/// total, minimum and maximum time and a histogram with four buckets
+/// per power of two for the 99th percentile. Add() can be called by
+/// several threads at once, the statistics can be read by other threads
+/// at any time.
+
+#define TATIMESTATS_NBUCKETS 256
+
+class TATimeStats
+{
+public:
+   std::string fName;
+
+public:
+   TATimeStats(const std::string& name); // ctor
+   void Add(uint64_t ns); // record one call
+   void Stop(uint64_t start_ns) { if (start_ns) Add(Now() - start_ns); } // record one call started by TATiming::Start()
+   void Reset();
+
+   uint64_t GetCount() const { return fCount.load(std::memory_order_relaxed); }
+   uint64_t GetTotal() const { return fTotal.load(std::memory_order_relaxed); }
+   uint64_t GetMin() const { return fMin.load(std::memory_order_relaxed); }
+   uint64_t GetMax() const { return fMax.load(std::memory_order_relaxed); }
+   uint64_t GetPercentile(double p) const; // upper edge of the histogram bucket, in ns
+
+   static uint64_t Now(); // monotonic time in ns
+
+private:
+   std::atomic<uint64_t> fCount;
+   std::atomic<uint64_t> fTotal;
+   std::atomic<uint64_t> fMin;
+   std::atomic<uint64_t> fMax;
+   std::atomic<uint32_t> fBuckets[TATIMESTATS_NBUCKETS];
+
+private:
+   TATimeStats(); // hidden default constructor
+   TATimeStats(const TATimeStats&); // not copyable
+};
+
+// ==================== Class TATiming ==================== //
+
+/// Timing of all the module calls of one run, of reading and writing events
+/// and of whole events. Reset by RunHandler::BeginRun(), printed at EndRun().
+/// With --timing<NNN> the table is also printed every NNN seconds while
+/// the run is going.
+
+class TATiming
+{
+public:
+   static bool   fgEnabled; // --timing
+   static double fgInterval; // print the table every so many seconds, 0 for only at end of run
+
+   std::vector<TATimeStats*> fBeginRun; // one per module
+   std::vector<TATimeStats*> fAnalyze;
+   std::vector<TATimeStats*> fAnalyzeFlow;
+   std::vector<TATimeStats*> fAnalyzeParallel;
+   std::vector<TATimeStats*> fEndRun;
+   TATimeStats fRead; // TAEventReader::Read(), TMReadEvent()
+   TATimeStats fWrite; // TMWriteEvent()
+   TATimeStats fEvent; // whole event, all modules
+
+   double fStartTime; // GetTimeSec() at begin of run
+   double fLastPrint; // GetTimeSec() of the last live printout
+
+public:
+   TATiming(); // ctor
+   ~TATiming(); // dtor
+   void Setup(const std::vector<TARunObject*>& modules); // new counters, one set per module
+   void Print(const char* title) const; // print the table through TALog
+   void PrintLive(); // print the table if fgInterval has passed since the last time
+
+   static uint64_t Start() { return fgEnabled ? TATimeStats::Now() : 0; } // 0 if timing is disabled
+
+private:
+   void Clear();
+};
+
+// ==================== Class TAMemory ==================== //
+
+/// Memory accounting (-m): RSS and peak RSS are sampled from /proc/self
+/// every fgInterval events, the heap growth during Analyze() of each module
+/// is measured with mallinfo2() (not with --mt or --workers, the heap is
+/// shared by all threads). A warning is printed if RSS grows by more than
+/// fgWarnKB per 10000 events. Reset by RunHandler::BeginRun(), printed at EndRun().
+
+class TAMemory
+{
+public:
+   static bool fgEnabled; // -m
+   static int  fgInterval; // sample RSS every so many events
+   static int  fgWarnKB; // warn if RSS grows by more than this per 10000 events, 0 to disable
+
+   std::vector<std::string> fNames; // one per module
+   std::vector<int64_t> fAnalyzeHeap; // heap growth in Analyze() of each module, bytes
+
+   uint64_t fEvents; // events of this run
+   uint64_t fLastEvents; // fEvents at the last sample
+   int64_t  fStartRss; // RSS at begin of run, kB
+   int64_t  fLastRss; // RSS at the last sample, kB
+
+public:
+   TAMemory(); // ctor
+   void Setup(const std::vector<TARunObject*>& modules); // new counters, one per module
+   void Event(); // count one event, sample RSS every fgInterval events
+   void Print(const char* title) const; // print the summary through TALog
+
+   static int64_t Start() { return fgEnabled ? HeapInUse() : 0; }
+   void Stop(unsigned module, int64_t start) { if (fgEnabled) fAnalyzeHeap[module] += HeapInUse() - start; }
+
+   static int64_t HeapInUse(); // bytes allocated by malloc()
+   static bool ReadRss(int64_t* rss_kb, int64_t* peak_kb); // from /proc/self/statm and /proc/self/status
+};
+
+// ==================== Class TAArena ==================== //
+
+/// Per-event memory arena: Alloc() carves memory out of large blocks,
+/// Reset() after each event makes all of it available again without
+/// returning it to the system. Destructors of objects placed in the
+/// arena are not called. RunHandler makes the arena of the event
+/// being analyzed available to the modules through TAArena::GetCurrent().
+
+class TAArena
+{
+public:
+   TAArena(size_t block_size = 64*1024); // ctor
+   ~TAArena(); // dtor
+   void* Alloc(size_t size, size_t align = 16);
+   void Reset(); // release all allocations, keep the memory
+   bool Contains(const void* ptr) const;
+
+   static TAArena* GetCurrent() { return fgCurrent; } // arena of the event analyzed by this thread
+   static void SetCurrent(TAArena* arena) { fgCurrent = arena; }
+
+private:
+   struct Block { char* fData; size_t fSize; };
+   std::vector<Block> fBlocks;
+   size_t fBlockSize;
+   size_t fBlock; // block in use
+   size_t fPos; // first free byte in the block in use
+
+   static thread_local TAArena* fgCurrent;
+};
+
+// ==================== Class TAEventPool ==================== //
+
+/// Recycles TMEvent objects: NewEvent() reuses a returned event and its
+/// data and bank buffers, so in steady state no memory is allocated per event.
+/// DeleteEvent() keeps at most as many events as NewEvent() handed out,
+/// events made elsewhere (TMReadEvent() of the file reader) are deleted.
+
+class TAEventPool
+{
+public:
+   TAEventPool(); // ctor
+   ~TAEventPool(); // dtor, deletes the pooled events
+   TMEvent* NewEvent(const void* data, size_t size); // same as new TMEvent(data, size)
+   void DeleteEvent(TMEvent* event); // return the event to the pool
+
+private:
+   std::mutex fMutex;
+   std::vector<TMEvent*> fFree;
+   size_t fNumOut; // events from NewEvent() not yet returned
+};
+
+// ==================== Class TAEventReader ==================== //
+
+/// Reads events from a list of data files. With a non-zero read-ahead
+/// depth (--readahead), reading and decompression run on a background
+/// thread that fills a ring buffer of up to "depth" events and moves on
+/// to the next file as soon as the current one reaches EOF. With mmap
+/// enabled (--mmap), uncompressed .mid files are mapped into memory and
+/// data events are returned as TMEventView pointing into the mapping.
+/// Mapped files use the event index sidecar file (.mid.idx) to skip
+/// events by seeking, the index is written after the first full pass.
+
+struct TAEventReaderEntry
+{
+   TMEvent* fEvent;
+   int fFileIndex;
+};
+
+class TAEventReader
+{
+public:
+   std::vector<std::string> fFiles;
+   int fDepth; // size of the read-ahead ring buffer, 0 to read inline
+   bool fMmap; // map uncompressed files
+
+public:
+   TAEventReader(const std::vector<std::string>& files, int depth, bool mmap); // ctor, starts the read-ahead thread
+   ~TAEventReader(); // dtor, stops the read-ahead thread, deletes unread events
+
+   /// Read the next event, returns false after the last event of the last file.
+   /// Returns either an event owned by the caller in "event" or, for data events
+   /// of a mapped file, sets "event" to NULL and fills "view". The view
+   /// is valid until the next call to Read().
+   bool Read(int* file_index, TMEvent** event, TMEventView* view);
+
+   int SkipDataEvents(int num_skip); // seek over data events of an indexed file, returns number of skipped events
+   int SkipToSerial(uint32_t serial_number); // seek to data event with given serial number in an indexed file
+
+private:
+   bool ReadNext(int* file_index, TMEvent** event, TMEventView* view); // read next event from the files
+   void CloseFile();
+   void Thread();
+
+   TMReaderInterface* fReader;
+   TMMappedFile* fMapped;
+   TMEventIndex* fIndex; // index of the mapped file
+   bool fIndexLoaded; // index read from file, otherwise it is made while reading
+   int fFileIndex;
+
+   std::thread fThread;
+   std::mutex fMutex;
+   std::condition_variable fCond;
+   std::vector<TAEventReaderEntry> fRing;
+   unsigned fHead; // next entry to be read by Read()
+   unsigned fCount; // number of entries in the ring buffer
+   bool fEof; // read-ahead thread is done
+   bool fStop; // ask the read-ahead thread to stop
+
+private:
+   TAEventReader(); // hidden default constructor
+};
+
+// ==================== Class TAAsyncWriter ==================== //
+
+/// Output writer (-o) that queues the data for a separate thread, so slow
+/// disks and compression do not stall the analysis. At most "max_bytes"
+/// are queued, Write() waits for the writer thread if there is more.
+
+class TAAsyncWriter: public TMWriterInterface
+{
+public:
+   TAAsyncWriter(TMWriterInterface* writer, size_t max_bytes); // ctor, takes ownership of the writer, starts the writer thread
+   ~TAAsyncWriter(); // dtor, closes and deletes the writer
+
+   int Write(const void* buf, int count);
+   int Close(); // write out everything, stop the writer thread and close the writer
+   void Flush(); // wait until everything queued is written
+
+   static void FlushAll(); // Flush() all writers, at end of run and of subrun
+
+private:
+   void Thread();
+
+   TMWriterInterface* fWriter;
+   size_t fMaxBytes;
+   size_t fChunkBytes; // wake up the writer thread when this much is queued
+
+   std::thread fThread;
+   std::mutex fMutex;
+   std::condition_variable fCond; // data queued, flush or stop requested
+   std::condition_variable fWritten; // writer thread finished a write
+   std::string fBuffer; // queued data
+   size_t fWriting; // bytes being written by the writer thread
+   bool fFlush; // write out the queue even if it is smaller than fChunkBytes
+   bool fStop;
+   bool fError;
+   double fTotalBytes;
+   int fWaits; // times Write() had to wait for the writer thread
+
+private:
+   TAAsyncWriter(); // hidden default constructor
+};
+
+// ==================== Class TAPipeline ==================== //
+
+/// Multithreaded event pipeline (--mt): each module runs in its own thread.
+/// An event first travels through the Analyze() stage of every module,
+/// then through the AnalyzeFlowEvent() stage of every module. Each stage
+/// is fed by a FIFO queue, so every module sees the events in order.
+
+struct TAPipelineItem
+{
+   TAArena fArena; // per-event memory
+   TMEvent* fEvent;
+   TAFlowEvent* fFlow;
+   TAFlags fFlags;
+   uint64_t fStartTime; // TATiming::Start() at Submit()
+   bool fFlowPhase; // false: in the Analyze() stages, true: in the AnalyzeFlowEvent() stages
+   bool fRunFlow;   // run the AnalyzeFlowEvent() stages
+   TMWriterInterface* fWriter;
+};
+
+struct TAPipelineStage
+{
+   std::mutex fMutex;
+   std::condition_variable fCond;
+   std::deque<TAPipelineItem*> fQueue;
+};
+
+class TAPipeline
+{
+public:
+   TARunInfo* fRunInfo;
+   std::vector<TARunObject*> fModules;
+   int fMaxBacklog; // maximum number of events in flight
+   std::atomic<bool> fQuit; // some module returned TAFlag_QUIT
+
+public:
+   TAPipeline(TARunInfo* runinfo, const std::vector<TARunObject*>& modules, int max_backlog, TAEventPool* pool, TATiming* timing); // ctor, starts the threads
+   ~TAPipeline(); // dtor, drains the queues and stops the threads
+   void Submit(TMEvent* event, TMWriterInterface* writer); // takes ownership of the event
+   void Drain(); // wait until all submitted events are done
+
+private:
+   void Thread(unsigned stage);
+   void Push(unsigned stage, TAPipelineItem* item);
+   TAPipelineItem* Pop(unsigned stage);
+   void Done(TAPipelineItem* item);
+
+   std::vector<TAPipelineStage*> fStages;
+   std::vector<std::thread> fThreads;
+   std::atomic<bool> fShutdown;
+
+   std::mutex fBacklogMutex;
+   std::condition_variable fBacklogCond;
+   int fBacklog;
+   std::vector<TAPipelineItem*> fFreeItems; // recycled items, protected by fBacklogMutex
+   TAEventPool* fEventPool;
+   TATiming* fTiming;
+
+private:
+   TAPipeline(); // hidden default constructor
+};
+
+// ==================== Class TAWorkPool ==================== //
+
+/// Event-level parallelism (--workers): AnalyzeParallel() of the modules
+/// with fParallel set runs on a pool of worker threads, many events at
+/// the same time. RunHandler hands out the events in batches, each worker
+/// takes batches from its own queue and steals from the other queues when
+/// it runs out. Then RunHandler runs Analyze() and AnalyzeFlowEvent() of
+/// all modules on the main thread, in the order of the events, with the
+/// flow made by AnalyzeParallel(). So AnalyzeParallel() must not touch
+/// anything shared between events (histograms, output files, state that
+/// depends on the previous events), that goes into Analyze().
+
+// up to 4*workers*batch items are kept for reuse, each with its own
+// arena, so the arena blocks are small: the flow events of one event
+// usually need only a few hundred bytes, larger events get more blocks
+
+#define TAWORKITEM_ARENA_BLOCK (4*1024)
+
+struct TAWorkItem
+{
+   TAArena fArena; // per-event memory
+   TMEvent* fEvent;
+   TAFlowEvent* fFlow;
+   TAFlags fFlags;
+   uint64_t fStartTime; // TATiming::Start() at submission
+   TMWriterInterface* fWriter;
+   std::atomic<bool> fDone; // AnalyzeParallel() finished
+
+   TAWorkItem() : fArena(TAWORKITEM_ARENA_BLOCK) {} // ctor
+};
+
+class TAWorkPool
+{
+public:
+   TARunInfo* fRunInfo;
+   std::vector<TARunObject*> fModules; // with fParallel set
+
+public:
+   TAWorkPool(TARunInfo* runinfo, const std::vector<TARunObject*>& modules, int nthreads, TATiming* timing); // ctor, starts the threads
+   ~TAWorkPool(); // dtor, stops the threads, all submitted items must be done
+   void Submit(const std::vector<TAWorkItem*>& batch); // queue a batch of events for one worker
+   void Wait(TAWorkItem* item); // wait until AnalyzeParallel() of the event is done
+
+private:
+   void Thread(unsigned index);
+   TAWorkItem* Pop(unsigned index); // from the own queue, or stolen from another one
+   void Run(TAWorkItem* item);
+
+   struct Queue
+   {
+      std::mutex fMutex;
+      std::deque<TAWorkItem*> fItems;
+   };
+
+   std::vector<Queue*> fQueues; // one per worker
+   std::vector<std::thread> fThreads;
+   std::vector<unsigned> fModuleIndex; // index of fModules[i] in the timing table
+   TATiming* fTiming;
+   unsigned fNextQueue; // queue of the next batch
+
+   std::mutex fMutex;
+   std::condition_variable fWorkCond; // workers wait for items
+   std::condition_variable fDoneCond; // Wait() waits for items
+   int fNumQueued; // items queued and not yet taken by a worker
+   bool fShutdown;
+
+private:
+   TAWorkPool(); // hidden default constructor
+};
+
 // ==================== Class RunHanler ==================== //
 
 class RunHandler
@@ -216,6 +724,12 @@ public:
    TARunInfo* fRunInfo;
    std::vector<TARunObject*> fRunRun;
    std::vector<std::string>  fArgs;
+   TAPipeline* fPipeline; // NULL unless running multithreaded
+   TAWorkPool* fWorkPool; // NULL unless running with --workers
+   TAEventPool fEventPool; // recycled events
+   TAArena fArena; // per-event memory, reset after each event
+   TATiming fTiming; // --timing statistics of the current run
+   TAMemory fMemory; // -m memory accounting of the current run
 
 public:
    RunHandler(const std::vector<std::string>& args); //ctor
@@ -227,6 +741,29 @@ public:
    void DeleteRun();
    void AnalyzeSpecialEvent(TMEvent* event);
    void AnalyzeEvent(TMEvent* event, TAFlags* flags, TMWriterInterface *writer);
+   void QueueEvent(TMEvent* event, TAFlags* flags, TMWriterInterface *writer); // takes ownership of the event
+   void AnalyzeEventView(const TMEventView* event, TAFlags* flags, TMWriterInterface *writer); // zero-copy AnalyzeEvent()
+   void AnalyzeBatch(TMEvent** events, int n, TAFlags* flags, TMWriterInterface *writer); // AnalyzeEvent() of a block of events (--batch), takes ownership of the events
+   void RefreshDisplay(bool force = false); // call RefreshDisplay() of all modules every --refresh seconds, if there is a display
+
+private:
+   void AnalyzeModules(TMEvent* event, TAFlags* flags, TMWriterInterface *writer, TAFlowEvent* flow); // Analyze(), then AnalyzeFlow()
+   void AnalyzeFlow(TMEvent* event, TAFlags* flags, TMWriterInterface *writer, TAFlowEvent* flow); // AnalyzeFlowEvent(), write, delete the flow
+   void FinishWork(); // serial part of the oldest event given to the worker pool
+   void DrainWork(); // FinishWork() all events given to the worker pool
+
+   double fLastRefresh; // GetTimeSec() of the last RefreshDisplay()
+
+   std::deque<TAWorkItem*> fWorkQueue; // events in the worker pool, oldest first
+   std::vector<TAWorkItem*> fWorkBatch; // events not yet submitted
+   std::vector<TAWorkItem*> fWorkFree; // recycled items
+   bool fWorkQuit; // some module returned TAFlag_QUIT
+
+   std::vector<TAFlowEvent*> fBatchFlows; // AnalyzeBatch(), one per event
+   std::vector<TMEvent*> fBatchModuleEvents; // AnalyzeBatch(), events given to one module
+   std::vector<TAFlags> fBatchModuleFlags;
+   std::vector<TAFlowEvent*> fBatchModuleFlows;
+   std::vector<int> fBatchModuleIndex;
 };
 
 
@@ -1,5 +1,9 @@
 // mesadc32unpack.h
 
+#ifndef MESADC32UNPACK_H
+#define MESADC32UNPACK_H
+
+#include <stdint.h>
 #include <vector>
 
 class mesadc32hit
@@ -27,10 +31,86 @@ public:
 
 public:
    mesadc32event(); // ctor
+   void Reset(); // clear the event, keep the memory of the hits vector
+   void Print() const;
+};
+
+#define MESADC32_MAX_HITS 32 // one hit per channel
+
+// storage for the hits of one event, provided by the caller and reused,
+// structure of arrays filled by the vectorized decoder
+
+struct mesadc32buffer
+{
+   uint8_t  channel[MESADC32_MAX_HITS]; // 5 bits
+   uint8_t  v[MESADC32_MAX_HITS]; // 1 bit // overflow bit
+   uint16_t adc_data[MESADC32_MAX_HITS]; // 12 bits
+};
+
+// decoded event, the hits point into the caller's mesadc32buffer
+
+struct mesadc32result
+{
+   bool error;
+   int module_id; // 8 bits
+   int nwords32; // 12 bits
+   int time_stamp; // 30 bits
+   int nhits;
+   const uint8_t*  channel;
+   const uint8_t*  v;
+   const uint16_t* adc_data;
+
    void Print() const;
 };
 
 mesadc32event* UnpackMesadc32(const char** data, int* datalen, bool verbose);
+void UnpackMesadc32(const char** data, int* datalen, bool verbose, mesadc32event* e); // decode into a reused event
+mesadc32result DecodeMesadc32(const char** data, int* datalen, mesadc32buffer* buf, bool verbose); // never allocates, see DecodeMesadc32T()
+
+// decode up to "count" (at most MESADC32_MAX_HITS) data words into hits,
+// stops at the first word that is not a data word, returns the number of hits.
+// Uses AVX2 or SSE4.2 if the CPU has them.
+int DecodeMesadc32Words(const uint32_t* words, int count, mesadc32buffer* buf);
+
+// decoder policies: production decoding has no diagnostics at all,
+// verbose prints every word, strict checks the word signatures and
+// the header word count and reports every problem
+
+struct Mesadc32Production
+{
+   static const bool kVerbose = false;
+   static const bool kStrict = false;
+   static const bool kVectorized = true;
+};
+
+struct Mesadc32Verbose
+{
+   static const bool kVerbose = true;
+   static const bool kStrict = false;
+   static const bool kVectorized = false;
+};
+
+struct Mesadc32Strict
+{
+   static const bool kVerbose = false;
+   static const bool kStrict = true;
+   static const bool kVectorized = false;
+};
+
+template<class Policy>
+mesadc32result DecodeMesadc32T(const char** data, int* datalen, mesadc32buffer* buf);
+
+extern template mesadc32result DecodeMesadc32T<Mesadc32Production>(const char** data, int* datalen, mesadc32buffer* buf);
+extern template mesadc32result DecodeMesadc32T<Mesadc32Verbose>(const char** data, int* datalen, mesadc32buffer* buf);
+extern template mesadc32result DecodeMesadc32T<Mesadc32Strict>(const char** data, int* datalen, mesadc32buffer* buf);
+
+// pick the decoder once (i.e. per run) instead of testing flags for every word
+
+typedef mesadc32result (*Mesadc32DecodeFunc)(const char** data, int* datalen, mesadc32buffer* buf);
+
+Mesadc32DecodeFunc SelectMesadc32Decoder(bool verbose, bool strict);
+
+#endif
 
 //end
 /* emacs
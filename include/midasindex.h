@@ -0,0 +1,60 @@
+// midasindex.h
+//
+// Event index sidecar files for uncompressed MIDAS .mid files
+//
+
+#ifndef MIDASINDEX_H
+#define MIDASINDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "midasmmap.h"
+
+struct TMIndexEntry
+{
+   uint64_t offset; // offset of the event header in the data file
+   uint32_t serial_number;
+   uint16_t event_id;
+   uint16_t trigger_mask;
+   uint32_t data_size;
+   uint32_t reserved;
+};
+
+class TMEventIndex
+{
+public:
+   std::string fFilename; // data file
+   uint64_t fFileSize; // size of the data file when the index was made
+   int64_t  fFileMtime; // modification time of the data file when the index was made
+   std::vector<TMIndexEntry> fEntries; // all events, in file order
+   std::vector<uint32_t> fData; // entries of data events
+   std::vector<uint32_t> fSpecial; // entries of begin of run, end of run and message events
+
+public:
+   TMEventIndex(const char* filename); // ctor
+   void Add(const TMEventView* view); // add next event of the data file
+   bool Load(); // false if the index file is missing or out of date
+   bool Save(); // write the index file
+   static std::string IndexFilename(const char* filename) { return std::string(filename) + ".idx"; }
+   static TMEventIndex* Build(const char* filename); // index an uncompressed data file
+
+   long FindOffset(uint64_t offset) const; // first entry at or after the offset
+   long FindSerial(uint32_t serial_number) const; // first data event with serial number at or after the given one
+   long CountData(long entry) const; // number of data events before the entry
+   uint64_t Skip(uint64_t offset, int num_skip, int* skipped) const; // skip data events, stop at special events
+   uint64_t SkipToSerial(uint64_t offset, uint32_t serial_number, int* skipped) const; // skip data events with smaller serial numbers
+   void FindRunBoundaries(std::vector<long>* bor, std::vector<long>* eor) const; // begin and end of run entries
+};
+
+#endif
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
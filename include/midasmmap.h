@@ -0,0 +1,74 @@
+// midasmmap.h
+//
+// Zero-copy access to uncompressed MIDAS .mid files through mmap()
+//
+
+#ifndef MIDASMMAP_H
+#define MIDASMMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include "midasio.h"
+
+#define TMEVENT_HEADER_SIZE 16
+
+class TMEventView
+{
+public:
+   // event header
+   uint16_t event_id;
+   uint16_t trigger_mask;
+   uint32_t serial_number;
+   uint32_t time_stamp;
+   uint32_t data_size; // size of event data, excluding the event header
+
+   uint32_t bank_header_flags;
+
+   const char* header; // event header in the mapped file, not owned
+   size_t offset; // offset of the event header in the file
+
+public:
+   TMEventView(); // ctor
+   bool Parse(const char* ptr, size_t size); // false if the event is truncated
+   bool FindBank(const char* name, TMBank* bank) const; // bank->data_offset is relative to the event header
+   const char* GetEventData() const { return header + TMEVENT_HEADER_SIZE; }
+   const char* GetBankData(const TMBank* bank) const { return header + bank->data_offset; }
+   size_t GetSize() const { return TMEVENT_HEADER_SIZE + data_size; } // event size including the header
+   TMEvent* NewEvent() const; // make an owning copy of the event
+};
+
+class TMMappedFile
+{
+public:
+   std::string fFilename;
+   bool fError;
+   std::string fErrorString;
+
+   const char* fData; // mapped file
+   size_t fSize; // size of the mapped file
+   size_t fPos; // offset of the next event
+
+public:
+   TMMappedFile(const char* filename); // ctor
+   ~TMMappedFile(); // dtor, unmaps the file
+   bool ReadEvent(TMEventView* view); // false at EOF or on error
+   void Seek(size_t offset) { fPos = offset; }
+
+   static bool CanMap(const char* filename); // uncompressed .mid file?
+
+private:
+   TMMappedFile() {}; // hidden default constructor
+};
+
+#endif
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
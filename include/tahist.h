@@ -0,0 +1,218 @@
+// tahist.h
+//
+// Sharded histogram accumulators: lock-free filling of ROOT histograms
+// from several threads.
+//
+// TAH1D and TAH2D wrap a TH1D or TH2D. Fill() adds to a private copy of
+// the bins (a shard) of the calling thread, Flush() adds all shards into
+// the ROOT histogram. Fill() and Flush() must not run at the same time:
+// RunHandler calls TAHistogram::FlushAll() between events, before the
+// canvases are redrawn (RefreshDisplay()) and at end of run, before the
+// modules EndRun(). Everything else (Draw(), Write(), titles, ...) goes
+// to the ROOT histogram through operator->.
+//
+// TAH1I is for raw spectra of integer data (ADC and TDC values): the shard
+// has plain integer counters, FillHits() fills the spectra of all channels
+// of a module from the hit arrays. The counts are added to the TH1D in
+// Flush(), the TH1D is only up to date after FlushAll().
+//
+
+#ifndef TAHIST_H
+#define TAHIST_H
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include "TH1D.h"
+#include "TH2D.h"
+
+#define TAHIST_MAX_THREADS 64
+
+class TAHistogram
+{
+public:
+   TAHistogram(); // ctor
+   virtual ~TAHistogram(); // dtor, deletes the shards, not the ROOT histogram
+
+   void Flush(); // add the shards to the ROOT histogram and clear them
+   void Reset(); // reset the ROOT histogram and clear the shards
+
+   static void FlushAll(); // Flush() all histograms
+   static int ThreadIndex(); // index of the shard of the calling thread
+
+protected:
+   struct Shard
+   {
+      std::vector<double> fBins; // same layout as the ROOT histogram, including under- and overflow
+      std::vector<double> fSumw2; // if the ROOT histogram has Sumw2()
+      double fStats[7]; // same as TH1::GetStats(), 4 entries for 1D, 7 for 2D
+      double fEntries;
+      std::vector<uint64_t> fCounts; // instead of fBins, fSumw2 and fEntries for TAH1I
+      int64_t fSumX; // sum of in-range values for TAH1I
+      double fSumX2;
+   };
+
+   void Attach(TH1* h, int ncells, int nstats, bool counts = false); // use this ROOT histogram, NULL to detach
+
+   Shard* GetShard(int thread) // shard of this thread, made on first use
+   {
+      Shard* s = fShards[thread].load(std::memory_order_acquire);
+      if (!s)
+         s = NewShard(thread);
+      return s;
+   }
+
+   Shard* GetShard() { return GetShard(ThreadIndex()); }
+
+   TH1* fHist;
+   int fNcells;
+   int fNstats;
+   bool fSumw2;
+   bool fCounts;
+
+private:
+   Shard* NewShard(int thread);
+   void FlushCounts(Shard* s, double* stats);
+   void DeleteShards();
+
+   std::atomic<Shard*> fShards[TAHIST_MAX_THREADS];
+
+private:
+   TAHistogram(const TAHistogram&); // not copyable
+   TAHistogram& operator=(const TAHistogram&);
+};
+
+// uniform binning of one axis, precomputed
+
+struct TAHistAxis
+{
+   int fNbins;
+   double fXmin;
+   double fXmax;
+   double fScale; // bins per unit
+   const TAxis* fAxis; // for variable bin size
+
+   void Set(const TAxis* axis);
+
+   int FindBin(double x) const // same as TAxis::FindFixBin()
+   {
+      if (fAxis)
+         return fAxis->FindFixBin(x);
+      if (x < fXmin)
+         return 0;
+      if (!(x < fXmax))
+         return fNbins + 1;
+      int bin = 1 + (int)((x - fXmin)*fScale);
+      if (bin > fNbins) // rounding
+         bin = fNbins;
+      return bin;
+   }
+
+   bool InRange(int bin) const { return bin > 0 && bin <= fNbins; }
+};
+
+class TAH1D: public TAHistogram
+{
+public:
+   TAH1D& operator=(TH1D* h); // use this ROOT histogram
+   TH1D* operator->() const { return (TH1D*)fHist; }
+   operator TH1D*() const { return (TH1D*)fHist; }
+
+   void Fill(double x, double w = 1.0)
+   {
+      Shard* s = GetShard();
+      int bin = fX.FindBin(x);
+      s->fBins[bin] += w;
+      if (fSumw2)
+         s->fSumw2[bin] += w*w;
+      s->fEntries += 1;
+      if (fX.InRange(bin)) {
+         s->fStats[0] += w;
+         s->fStats[1] += w*w;
+         s->fStats[2] += w*x;
+         s->fStats[3] += w*x*x;
+      }
+   }
+
+private:
+   TAHistAxis fX;
+};
+
+class TAH2D: public TAHistogram
+{
+public:
+   TAH2D& operator=(TH2D* h); // use this ROOT histogram
+   TH2D* operator->() const { return (TH2D*)fHist; }
+   operator TH2D*() const { return (TH2D*)fHist; }
+
+   void Fill(double x, double y, double w = 1.0)
+   {
+      Shard* s = GetShard();
+      int binx = fX.FindBin(x);
+      int biny = fY.FindBin(y);
+      int bin = binx + (fX.fNbins + 2)*biny; // same as TH1::GetBin()
+      s->fBins[bin] += w;
+      if (fSumw2)
+         s->fSumw2[bin] += w*w;
+      s->fEntries += 1;
+      if (fX.InRange(binx) && fY.InRange(biny)) {
+         s->fStats[0] += w;
+         s->fStats[1] += w*w;
+         s->fStats[2] += w*x;
+         s->fStats[3] += w*x*x;
+         s->fStats[4] += w*y;
+         s->fStats[5] += w*y*y;
+         s->fStats[6] += w*x*y;
+      }
+   }
+
+private:
+   TAHistAxis fX;
+   TAHistAxis fY;
+};
+
+class TAH1I: public TAHistogram
+{
+public:
+   TAH1I& operator=(TH1D* h); // use this ROOT histogram
+   TH1D* operator->() const { return (TH1D*)fHist; }
+   operator TH1D*() const { return (TH1D*)fHist; }
+
+   void Fill(int x) { Fill(GetShard(), x); }
+
+   // fill x[i] into h[chan[i]], skip channels without a histogram and channels >= nh
+   template<typename C, typename T>
+   static void FillHits(TAH1I* h, int nh, int n, const C* chan, const T* x)
+   {
+      int thread = ThreadIndex();
+      for (int i=0; i<n; i++) {
+         int c = chan[i];
+         if (c < nh && h[c].fHist)
+            h[c].Fill(h[c].GetShard(thread), x[i]);
+      }
+   }
+
+private:
+   void Fill(Shard* s, int x)
+   {
+      int bin = fX.FindBin(x);
+      s->fCounts[bin]++;
+      if (fX.InRange(bin)) {
+         s->fSumX += x;
+         s->fSumX2 += (double)x*x;
+      }
+   }
+
+   TAHistAxis fX;
+};
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
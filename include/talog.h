@@ -0,0 +1,60 @@
+// talog.h
+//
+// Leveled, rate-limited logging with a background output thread
+//
+// Messages are formatted by the caller into a memory buffer and written
+// to stdout by a separate thread, so the event loop never waits for the
+// terminal. Messages are selected by level (TALog::fgLevel) and by
+// category (TALog::EnableCategory("emma.tdc"), enables all levels of that
+// category). Messages using the same format string are rate-limited.
+//
+
+#ifndef TALOG_H
+#define TALOG_H
+
+#include <string>
+
+#define TALOG_ERROR   0
+#define TALOG_WARNING 1
+#define TALOG_INFO    2
+#define TALOG_DEBUG   3 // per event
+#define TALOG_TRACE   4 // per hit
+
+class TALog
+{
+public:
+   static int      fgLevel; // messages up to this level are printed, default is TALOG_INFO
+   static unsigned fgCategories; // bit mask of categories enabled at all levels
+   static int      fgRateLimit; // at most this many messages per second with the same format string, 0 means unlimited
+   static size_t   fgMaxBuffered; // drop messages when this many bytes are waiting for the output thread
+
+public:
+   static unsigned Category(const char* name); // register a category, returns its bit, at most 32 categories
+   static void EnableCategory(const char* name); // "all" enables all categories
+   static int  ParseLevel(const char* s); // "error", "warning", "info", "debug", "trace" or a number, -1 if invalid
+
+   static bool Enabled(int level, unsigned category)
+   {
+      return (level <= fgLevel) || (category & fgCategories);
+   }
+
+   static void Print(int level, unsigned category, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+   static void Start(); // start the output thread
+   static void Flush(); // wait until everything is written out
+   static void Stop(); // flush, report suppressed messages and stop the output thread
+};
+
+// use the macro to skip formatting the message if it will not be printed
+
+#define TALOG(level, category, ...) do { if (TALog::Enabled((level), (category))) TALog::Print((level), (category), __VA_ARGS__); } while (0)
+
+#endif
+
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
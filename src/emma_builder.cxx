@@ -0,0 +1,243 @@
+// emma_builder.cxx
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "emma_builder.h"
+#include "v1190unpack.h"
+#include "emma_tdc.h"
+
+static unsigned gLogBuilder = TALog::Category("emma.builder");
+
+#define TDC_ETTT_BITS 27
+#define ADC_TS_BITS   30
+
+void EmmaAdcFragment::Set(const mesadc32result* r)
+{
+   fResult = *r;
+   int n = r->nhits;
+   if (n > MESADC32_MAX_HITS)
+      n = MESADC32_MAX_HITS;
+   memcpy(fHits.channel, r->channel, n*sizeof(fHits.channel[0]));
+   memcpy(fHits.v, r->v, n*sizeof(fHits.v[0]));
+   memcpy(fHits.adc_data, r->adc_data, n*sizeof(fHits.adc_data[0]));
+   fResult.nhits = n;
+}
+
+const mesadc32result* EmmaAdcFragment::GetResult()
+{
+   fResult.channel = fHits.channel;
+   fResult.v = fHits.v;
+   fResult.adc_data = fHits.adc_data;
+   return &fResult;
+}
+
+EmmaBuiltEvent::EmmaBuiltEvent(TAFlowEvent* flow) // ctor
+   : TAFlowEvent(flow)
+{
+   fTdc = NULL;
+   fTdcHits = NULL;
+   fTdcTime = 0;
+   fAdcTime = 0;
+}
+
+EmmaBuiltEvent::~EmmaBuiltEvent() // dtor
+{
+   if (fTdc)
+      delete fTdc;
+   fTdc = NULL;
+   EmmaTdcHits::Delete(fTdcHits);
+   fTdcHits = NULL;
+}
+
+EmmaUnpackedEvent::EmmaUnpackedEvent(TAFlowEvent* flow) // ctor
+   : TAFlowEvent(flow)
+{
+}
+
+EmmaUnpackedEvent::~EmmaUnpackedEvent() // dtor
+{
+   for (unsigned i=0; i<fTdc.size(); i++)
+      if (fTdc[i])
+         delete fTdc[i];
+   fTdc.clear();
+   for (unsigned i=0; i<fTdcHits.size(); i++)
+      EmmaTdcHits::Delete(fTdcHits[i]);
+   fTdcHits.clear();
+}
+
+// time stamp of "bits" bits to continuous time in ticks: counts the
+// rollovers, a time stamp from before the last rollover (out of order)
+// is placed before it
+
+static double Unwrap(uint32_t raw, int bits, uint32_t* last, double* wraps)
+{
+   double range = (double)((uint64_t)1<<bits);
+   int64_t d = (int64_t)raw - (int64_t)*last;
+
+   if (d < -range/2) { // rollover
+      *wraps += range;
+      *last = raw;
+      return *wraps + raw;
+   }
+
+   if (d > range/2) // late, from before the last rollover
+      return *wraps - range + raw;
+
+   if (d > 0)
+      *last = raw;
+
+   return *wraps + raw;
+}
+
+EmmaEventBuilder::EmmaEventBuilder() // ctor
+{
+}
+
+EmmaEventBuilder::~EmmaEventBuilder() // dtor
+{
+   while (!fTdcQueue.empty()) {
+      delete fTdcQueue.front().fTdc;
+      EmmaTdcHits::Delete(fTdcQueue.front().fTdcHits);
+      fTdcQueue.pop_front();
+   }
+   while (!fAdcQueue.empty()) {
+      delete fAdcQueue.front().fAdc;
+      fAdcQueue.pop_front();
+   }
+}
+
+void EmmaEventBuilder::Insert(std::deque<Fragment>* q, const Fragment& f)
+{
+   // fragments arrive almost in time order, search from the back
+   std::deque<Fragment>::iterator it = q->end();
+   while (it != q->begin() && (it-1)->fTime > f.fTime)
+      --it;
+   q->insert(it, f);
+}
+
+void EmmaEventBuilder::AddTdc(v1190event* te, EmmaTdcHits* hits)
+{
+   uint32_t raw = (uint32_t)te->ettt & ((1u<<TDC_ETTT_BITS) - 1);
+   if (fNumTdc == 0)
+      fLastTdcRaw = raw;
+   fNumTdc++;
+
+   Fragment f;
+   f.fTime = Unwrap(raw, TDC_ETTT_BITS, &fLastTdcRaw, &fTdcWraps)*fTdcTickUs;
+   f.fTdc = te;
+   f.fTdcHits = hits;
+   f.fAdc = NULL;
+   Insert(&fTdcQueue, f);
+}
+
+void EmmaEventBuilder::AddAdc(const mesadc32result* ae)
+{
+   uint32_t raw = (uint32_t)ae->time_stamp & ((1u<<ADC_TS_BITS) - 1);
+   if (fNumAdc == 0)
+      fLastAdcRaw = raw;
+   fNumAdc++;
+
+   Fragment f;
+   f.fTime = Unwrap(raw, ADC_TS_BITS, &fLastAdcRaw, &fAdcWraps)*fAdcTickUs;
+   f.fTdc = NULL;
+   f.fTdcHits = NULL;
+   f.fAdc = new EmmaAdcFragment;
+   f.fAdc->Set(ae);
+   Insert(&fAdcQueue, f);
+}
+
+void EmmaEventBuilder::DropTdc()
+{
+   TALOG(TALOG_WARNING, gLogBuilder, "EmmaEventBuilder: dropped TDC event at %.1f usec, no matching ADC event\n", fTdcQueue.front().fTime);
+   delete fTdcQueue.front().fTdc;
+   EmmaTdcHits::Delete(fTdcQueue.front().fTdcHits);
+   fTdcQueue.pop_front();
+   fNumTdcDropped++;
+   fNumDroppedInRow++;
+}
+
+void EmmaEventBuilder::DropAdc()
+{
+   TALOG(TALOG_WARNING, gLogBuilder, "EmmaEventBuilder: dropped ADC event at %.1f usec, no matching TDC event\n", fAdcQueue.front().fTime);
+   delete fAdcQueue.front().fAdc;
+   fAdcQueue.pop_front();
+   fNumAdcDropped++;
+   fNumDroppedInRow++;
+}
+
+TAFlowEvent* EmmaEventBuilder::Build(TAFlowEvent* flow, bool flush)
+{
+   while (!fTdcQueue.empty() && !fAdcQueue.empty()) {
+      Fragment& t = fTdcQueue.front();
+      Fragment& a = fAdcQueue.front();
+
+      if (!fHaveOffset) {
+         fOffset = a.fTime - t.fTime;
+         fHaveOffset = true;
+      }
+
+      double d = (a.fTime - fOffset) - t.fTime;
+
+      if (fabs(d) <= fWindowUs) {
+         EmmaBuiltEvent* e = new EmmaBuiltEvent(flow);
+         e->fTdc = t.fTdc;
+         e->fTdcHits = t.fTdcHits;
+         e->fAdc = *a.fAdc;
+         e->fTdcTime = t.fTime;
+         e->fAdcTime = a.fTime;
+         flow = e;
+
+         fOffset = a.fTime - t.fTime; // follow the drift between the clocks
+         fNumBuilt++;
+         fNumDroppedInRow = 0;
+
+         delete a.fAdc;
+         fTdcQueue.pop_front();
+         fAdcQueue.pop_front();
+         continue;
+      }
+
+      // the earlier fragment may still get its partner from the next MIDAS events
+      if (!flush && fTdcQueue.size() <= fDepth && fAdcQueue.size() <= fDepth)
+         break;
+
+      if (d < 0)
+         DropAdc();
+      else
+         DropTdc();
+
+      // the clock offset is wrong if the first fragment had no partner,
+      // take it again from the next pair
+      if (fNumDroppedInRow > 2*fDepth) {
+         TALOG(TALOG_WARNING, gLogBuilder, "EmmaEventBuilder: %u events without partner, resynchronizing the ADC and TDC clocks\n", fNumDroppedInRow);
+         fHaveOffset = false;
+         fNumDroppedInRow = 0;
+      }
+   }
+
+   unsigned keep = flush ? 0 : fDepth;
+
+   while (fTdcQueue.size() > keep)
+      DropTdc();
+
+   while (fAdcQueue.size() > keep)
+      DropAdc();
+
+   return flow;
+}
+
+void EmmaEventBuilder::Print() const
+{
+   printf("EmmaEventBuilder: TDC events %d, ADC events %d, built %d, dropped TDC %d, ADC %d, window %.1f usec, depth %u\n", fNumTdc, fNumAdc, fNumBuilt, fNumTdcDropped, fNumAdcDropped, fWindowUs, fDepth);
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,226 @@
+// emma_calib.cxx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "emma_calib.h"
+#include "VirtualOdb.h"
+
+EmmaCalib::EmmaCalib() // ctor
+{
+   SetDefaults();
+}
+
+void EmmaCalib::SetDefaults()
+{
+   fTdcChannel[EMMA_TDC_AT]   = 0;
+   fTdcChannel[EMMA_TDC_AM]   = 4;
+   fTdcChannel[EMMA_TDC_AB]   = 8;
+   fTdcChannel[EMMA_TDC_XR]   = 12;
+   fTdcChannel[EMMA_TDC_XL]   = 16;
+   fTdcChannel[EMMA_TDC_YT]   = 20;
+   fTdcChannel[EMMA_TDC_YB]   = 24;
+   fTdcChannel[EMMA_TDC_TRIG] = 28;
+   fTdcChannel[EMMA_TDC_RF]   = 32;
+   fTdcTrigSignal = -1;
+
+   fAdcChannel[EMMA_ADC_AT]  = 0;
+   fAdcChannel[EMMA_ADC_AM]  = 1;
+   fAdcChannel[EMMA_ADC_AB]  = 2;
+   fAdcChannel[EMMA_ADC_SI]  = 16;
+   fAdcChannel[EMMA_ADC_SBL] = 18;
+   fAdcChannel[EMMA_ADC_SBR] = 20;
+
+   fXlOffset = 40.0; // 4 ns cable delay for XL
+   fXrOffset = 20.0; // 2 ns cable delay for XR
+   fYbOffset = 20.0; // 2 ns cable delay for YB
+   fYtOffset = 10.0; // 1 ns cable delay for YT
+   fXScale = 80.0;
+   fYScale = 30.0;
+   fXDiffScale = 0.0222;
+   fYDiffScale = 0.0226;
+   fGatedDiffScale = 0.02;
+   fSiGateMin = 800.0;
+   fSiGateMax = 1100.0;
+
+   memset(fTdcRole, -1, sizeof(fTdcRole));
+   memset(fAdcRole, -1, sizeof(fAdcRole));
+   fTdcTrigChannel = -1;
+}
+
+std::vector<EmmaCalib::Key> EmmaCalib::Keys()
+{
+   std::vector<Key> k;
+   k.push_back({"tdc_at",   &fTdcChannel[EMMA_TDC_AT],   NULL});
+   k.push_back({"tdc_am",   &fTdcChannel[EMMA_TDC_AM],   NULL});
+   k.push_back({"tdc_ab",   &fTdcChannel[EMMA_TDC_AB],   NULL});
+   k.push_back({"tdc_xr",   &fTdcChannel[EMMA_TDC_XR],   NULL});
+   k.push_back({"tdc_xl",   &fTdcChannel[EMMA_TDC_XL],   NULL});
+   k.push_back({"tdc_yt",   &fTdcChannel[EMMA_TDC_YT],   NULL});
+   k.push_back({"tdc_yb",   &fTdcChannel[EMMA_TDC_YB],   NULL});
+   k.push_back({"tdc_trig", &fTdcChannel[EMMA_TDC_TRIG], NULL});
+   k.push_back({"tdc_rf",   &fTdcChannel[EMMA_TDC_RF],   NULL});
+   k.push_back({"tdc_trig_signal", &fTdcTrigSignal, NULL});
+   k.push_back({"adc_at",   &fAdcChannel[EMMA_ADC_AT],  NULL});
+   k.push_back({"adc_am",   &fAdcChannel[EMMA_ADC_AM],  NULL});
+   k.push_back({"adc_ab",   &fAdcChannel[EMMA_ADC_AB],  NULL});
+   k.push_back({"adc_si",   &fAdcChannel[EMMA_ADC_SI],  NULL});
+   k.push_back({"adc_sbl",  &fAdcChannel[EMMA_ADC_SBL], NULL});
+   k.push_back({"adc_sbr",  &fAdcChannel[EMMA_ADC_SBR], NULL});
+   k.push_back({"xl_offset", NULL, &fXlOffset});
+   k.push_back({"xr_offset", NULL, &fXrOffset});
+   k.push_back({"yb_offset", NULL, &fYbOffset});
+   k.push_back({"yt_offset", NULL, &fYtOffset});
+   k.push_back({"x_scale", NULL, &fXScale});
+   k.push_back({"y_scale", NULL, &fYScale});
+   k.push_back({"x_diff_scale", NULL, &fXDiffScale});
+   k.push_back({"y_diff_scale", NULL, &fYDiffScale});
+   k.push_back({"gated_diff_scale", NULL, &fGatedDiffScale});
+   k.push_back({"si_gate_min", NULL, &fSiGateMin});
+   k.push_back({"si_gate_max", NULL, &fSiGateMax});
+   return k;
+}
+
+void EmmaCalib::ReadOdb(VirtualOdb* odb, const char* path)
+{
+   if (!odb)
+      return;
+
+   std::vector<Key> keys = Keys();
+   for (unsigned i=0; i<keys.size(); i++) {
+      char name[256];
+      snprintf(name, sizeof(name), "%s/%s", path, keys[i].fName);
+      if (odb->odbReadArraySize(name) < 1) // not in the ODB
+         continue;
+      if (keys[i].fInt)
+         *keys[i].fInt = odb->odbReadInt(name, 0, *keys[i].fInt);
+      else
+         *keys[i].fDouble = odb->odbReadDouble(name, 0, *keys[i].fDouble);
+   }
+}
+
+bool EmmaCalib::ReadFile(const char* filename)
+{
+   FILE* fp = fopen(filename, "r");
+   if (!fp) {
+      fprintf(stderr, "EmmaCalib: cannot open calibration file \"%s\", errno %d (%s)\n", filename, errno, strerror(errno));
+      return false;
+   }
+
+   std::vector<Key> keys = Keys();
+   bool ok = true;
+   int lineno = 0;
+   char line[1024];
+
+   while (fgets(line, sizeof(line), fp)) {
+      lineno++;
+
+      char* s = strchr(line, '#');
+      if (s)
+         *s = 0;
+
+      char name[256];
+      char value[256];
+      int n = sscanf(line, "%255s %255s", name, value);
+      if (n <= 0) // empty line
+         continue;
+
+      unsigned k = 0;
+      while (k < keys.size() && strcmp(keys[k].fName, name) != 0)
+         k++;
+
+      if (n != 2 || k == keys.size()) {
+         fprintf(stderr, "EmmaCalib: %s:%d: invalid line, should be \"name value\" with a known name\n", filename, lineno);
+         ok = false;
+         continue;
+      }
+
+      char* end = NULL;
+      if (keys[k].fInt)
+         *keys[k].fInt = strtol(value, &end, 0);
+      else
+         *keys[k].fDouble = strtod(value, &end);
+
+      if (*end != 0) {
+         fprintf(stderr, "EmmaCalib: %s:%d: invalid value \"%s\" for \"%s\"\n", filename, lineno, value, name);
+         ok = false;
+      }
+   }
+
+   fclose(fp);
+   return ok;
+}
+
+bool EmmaCalib::Compile(int runno)
+{
+   bool ok = true;
+
+   memset(fTdcRole, -1, sizeof(fTdcRole));
+   memset(fAdcRole, -1, sizeof(fAdcRole));
+
+   for (int r=0; r<EMMA_TDC_NROLES; r++) {
+      int chan = fTdcChannel[r];
+      if (chan < 0 || chan >= EMMA_TDC_CHANNELS) {
+         fprintf(stderr, "EmmaCalib: TDC channel %d of role %d is out of range 0..%d\n", chan, r, EMMA_TDC_CHANNELS-1);
+         ok = false;
+      } else if (fTdcRole[chan] >= 0) {
+         fprintf(stderr, "EmmaCalib: TDC channel %d has roles %d and %d\n", chan, fTdcRole[chan], r);
+         ok = false;
+      } else {
+         fTdcRole[chan] = r;
+      }
+   }
+
+   for (int r=0; r<EMMA_ADC_NROLES; r++) {
+      int chan = fAdcChannel[r];
+      if (chan < 0 || chan >= EMMA_ADC_CHANNELS) {
+         fprintf(stderr, "EmmaCalib: ADC channel %d of role %d is out of range 0..%d\n", chan, r, EMMA_ADC_CHANNELS-1);
+         ok = false;
+      } else if (fAdcRole[chan] >= 0) {
+         fprintf(stderr, "EmmaCalib: ADC channel %d has roles %d and %d\n", chan, fAdcRole[chan], r);
+         ok = false;
+      } else {
+         fAdcRole[chan] = r;
+      }
+   }
+
+   fTdcTrigChannel = fTdcTrigSignal;
+   if (fTdcTrigChannel < 0) {
+      if (runno < 202)
+         fTdcTrigChannel = 7;
+      else
+         fTdcTrigChannel = 7*4; // 28, V1290
+   }
+
+   if (!(fSiGateMin < fSiGateMax)) {
+      fprintf(stderr, "EmmaCalib: empty silicon energy gate %f..%f\n", fSiGateMin, fSiGateMax);
+      ok = false;
+   }
+
+   return ok;
+}
+
+void EmmaCalib::Print() const
+{
+   printf("EmmaCalib: TDC channels AT %d, AM %d, AB %d, XR %d, XL %d, YT %d, YB %d, trig %d, RF %d, trigger signal %d\n",
+          fTdcChannel[EMMA_TDC_AT], fTdcChannel[EMMA_TDC_AM], fTdcChannel[EMMA_TDC_AB],
+          fTdcChannel[EMMA_TDC_XR], fTdcChannel[EMMA_TDC_XL], fTdcChannel[EMMA_TDC_YT], fTdcChannel[EMMA_TDC_YB],
+          fTdcChannel[EMMA_TDC_TRIG], fTdcChannel[EMMA_TDC_RF], fTdcTrigChannel);
+   printf("EmmaCalib: ADC channels AT %d, AM %d, AB %d, Si %d, SBL %d, SBR %d\n",
+          fAdcChannel[EMMA_ADC_AT], fAdcChannel[EMMA_ADC_AM], fAdcChannel[EMMA_ADC_AB],
+          fAdcChannel[EMMA_ADC_SI], fAdcChannel[EMMA_ADC_SBL], fAdcChannel[EMMA_ADC_SBR]);
+   printf("EmmaCalib: offsets XL %.1f, XR %.1f, YB %.1f, YT %.1f, scales X %.1f, Y %.1f, diff %.4f %.4f, gated %.4f, Si gate %.1f..%.1f\n",
+          fXlOffset, fXrOffset, fYbOffset, fYtOffset, fXScale, fYScale,
+          fXDiffScale, fYDiffScale, fGatedDiffScale, fSiGateMin, fSiGateMax);
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
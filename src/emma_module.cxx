@@ -6,6 +6,43 @@
 
 #include "emma_module.h"
 
+#include <new> // placement new
+#include <map>
+#include <glob.h>
+#include <unistd.h> // unlink()
+
+static unsigned gLogEmma = TALog::Category("emma");
+static unsigned gLogTdc = TALog::Category("emma.tdc");
+static unsigned gLogAdc = TALog::Category("emma.adc");
+
+EmmaScratch* EmmaScratch::New()
+{
+   void* ptr = NULL;
+   if (posix_memalign(&ptr, 64, sizeof(EmmaScratch)) != 0) {
+      fprintf(stderr, "EmmaScratch::New: cannot allocate %d bytes\n", (int)sizeof(EmmaScratch));
+      abort();
+   }
+   EmmaScratch* s = new (ptr) EmmaScratch;
+   for (int i=0; i<EMMA_ADC_CHANNELS; i++)
+      s->fEnergy[i] = 0;
+   s->fAdcTouched = 0;
+   return s;
+}
+
+void EmmaScratch::Delete(EmmaScratch* s)
+{
+   if (!s)
+      return;
+   s->~EmmaScratch();
+   free(s);
+}
+
+void EmmaScratch::Reset()
+{
+   for (int chan=0; fAdcTouched; chan++, fAdcTouched >>= 1)
+      if (fAdcTouched & 1)
+         fEnergy[chan] = 0;
+}
 
 EmmaModule::EmmaModule(TARunInfo* runinfo, EmmaConfig* config):
    TARunObject(runinfo)
@@ -13,6 +50,15 @@ EmmaModule::EmmaModule(TARunInfo* runinfo, EmmaConfig* config):
    printf("EmmaModule::ctor!\n");
 
    fConfig = config;
+   fEventView = true; // AnalyzeView() is implemented
+   fParallel = true; // bank unpacking and TDC reduction in AnalyzeParallel()
+   fDecodeAdc = SelectMesadc32Decoder(fConfig->fVerboseMesadc32, fConfig->fStrictMesadc32);
+   fOutput = NULL;
+   fScratch = EmmaScratch::New();
+
+   fBuilder.fWindowUs = fConfig->fBuildWindowUs;
+   fBuilder.fDepth = fConfig->fBuildDepth;
+   fBuilder.fAdcTickUs = fConfig->fAdcTickUs;
 
    // initialize canvases
 
@@ -76,7 +122,6 @@ EmmaModule::EmmaModule(TARunInfo* runinfo, EmmaConfig* config):
    // **************************************
    // INITIALIZATION
    // **************************************
-   ct = 0;
    // initialize histograms
    char name[100];
    Float_t diffmin=-100;
@@ -263,17 +308,20 @@ EmmaModule::~EmmaModule()
    DELETE(fCanvasCathodeMulti);
    DELETE(fCanvasRF);
    DELETE(fCanvasSSB);
+   DELETE(fOutput);
+   EmmaScratch::Delete(fScratch);
+   fScratch = NULL;
 
 } //end ~EmmaModule
 
 void EmmaModule::ResetHistograms()
 {
    for (int i=0; i<64; i++) {
-      fHTdcRaw[i]->Reset();
+      fHTdcRaw[i].Reset();
    }
 
    for (int i=0; i<32; i++) {
-      fHAdcRaw[i]->Reset();
+      fHAdcRaw[i].Reset();
    }
 
    //  for (int i=0; i<9; i++) {
@@ -281,180 +329,91 @@ void EmmaModule::ResetHistograms()
    // }
 
    for(int i =0; i < 2; i++) {
-      x_y_diff[i]->Reset();
-      x_y_diff_Gated[i]->Reset();
-      x_y_sum[i]->Reset();
+      x_y_diff[i].Reset();
+      x_y_diff_Gated[i].Reset();
+      x_y_sum[i].Reset();
       x_y_diff_vs_sum[i]->Reset();
    }
 
    for(int i =0; i < 6; i++) {
-      hADC_used[i]->Reset();
-   }
-
-   hSienergy->Reset();
-   hdE_E->Reset();
-   hXPosition->Reset();
-   hXPosition_Gated->Reset();
-   hYPosition->Reset();
-   hYPosition_Gated->Reset();
-   hXYPosition->Reset();
-   hXYPosition_Gated->Reset();
-   hRF->Reset();
-   hsbl->Reset();
-   hsbr->Reset();
-
-   hmulti_at->Reset();
-   hmulti_am->Reset();
-   hmulti_ab->Reset();
-   hmulti_xr->Reset();
-   hmulti_xl->Reset();
-   hmulti_yt->Reset();
-   hmulti_yb->Reset();
-   hmulti_trig->Reset();
+      hADC_used[i].Reset();
+   }
+
+   hSienergy.Reset();
+   hdE_E.Reset();
+   hXPosition.Reset();
+   hXPosition_Gated.Reset();
+   hYPosition.Reset();
+   hYPosition_Gated.Reset();
+   hXYPosition.Reset();
+   hXYPosition_Gated.Reset();
+   hRF.Reset();
+   hsbl.Reset();
+   hsbr.Reset();
+
+   hmulti_at.Reset();
+   hmulti_am.Reset();
+   hmulti_ab.Reset();
+   hmulti_xr.Reset();
+   hmulti_xl.Reset();
+   hmulti_yt.Reset();
+   hmulti_yb.Reset();
+   hmulti_trig.Reset();
 
 } //end ResetHistograms
 
-void EmmaModule::UpdateHistograms(TARunInfo* runinfo, const v1190event* tdc_data, const mesadc32event* adc_data)
+void EmmaModule::UpdateHistograms(TARunInfo* runinfo, const EmmaTdcSummary* tdc, const mesadc32result* adc_data, double adc_time)
 {
-   double adc_dt = 0;
-   double tdc_dt = 0;
-
-   if (1) {
-      double ts = tdc_data->ettt/1.25;
-      static double prevts = 0;
-      if (prevts == 0) {
-         prevts = ts;
-      } else {
-         double dt = ts - prevts;
-         //printf("TDC ts %8d, dt %5d\n", (int)ts, (int)dt);
-         //fHAdcTime->Fill(dt);
-         prevts = ts;
-         tdc_dt = dt;
-      }
-   }
-
-   if (1) {
-      static int prevts = 0;
-      int ts = adc_data->time_stamp;
-      if (prevts == 0) {
-         prevts = ts;
-      } else {
-         int dt = ts - prevts;
-         //printf("ts %8d, dt %5d\n", ts, dt);
-         prevts = ts;
-         adc_dt = dt;
-      }
-   }
-
-   printf("tscheck: ADC %.0f, TDC %.0f\n", adc_dt, tdc_dt);
+   // time stamps are unwrapped by the event builder, no jumps at rollover
+   double tdc_dt = fTdcDelta.Delta(tdc->fTdcTime);
+   double adc_dt = fAdcDelta.Delta(adc_time);
 
-   fHAdcTime0->Fill(adc_dt);
-   fHTdcTime0->Fill(tdc_dt);
-   fHAdcTime1->Fill(adc_dt);
-   fHTdcTime1->Fill(tdc_dt);
-   fHAdcTime2->Fill(adc_dt);
-   fHTdcTime2->Fill(tdc_dt);
-   fHAdcTdcTime->Fill(adc_dt - tdc_dt);
+   TALOG(TALOG_DEBUG, gLogEmma, "tscheck: ADC %.0f, TDC %.0f\n", adc_dt, tdc_dt);
 
-   std::vector<int> anode_pathway(9,0);
-   std::vector<double> earliest_times(64,999999);
-   std::vector<int> counts(64,0);
-   Double_t datum[64][20] = {{0}};
+   fHAdcTime0.Fill(adc_dt);
+   fHTdcTime0.Fill(tdc_dt);
+   fHAdcTime1.Fill(adc_dt);
+   fHTdcTime1.Fill(tdc_dt);
+   fHAdcTime2.Fill(adc_dt);
+   fHTdcTime2.Fill(tdc_dt);
+   fHAdcTdcTime.Fill(adc_dt - tdc_dt);
 
+   const EmmaCalib* calib = &fCalib;
+   const EmmaTdcHits* hits = tdc->fHits;
 
-   //double tdc_bin = 0.01; // 100ps V1190
-   int tdc_trig_chan = 7;
-   Double_t xloffset = 40.0; // 4 ns cable delay for XL
-   Double_t xroffset = 20.0; // 2 ns cable delay for XR
-   Double_t yboffset = 20.0; // 2 ns cable delay for YB
-   Double_t ytoffset = 10.0; // 1 ns cable delay for YT
-   Int_t hit = 0;
-   Int_t tdchit = 0; // for TDC
+   //double tdc_bin = 0.01; // 100ps V1190, 0.025 V1290 from run 202
 
-   if (runinfo->fRunNo >= 202) {
-      //tdc_bin = 0.025; // 25ps V1290
-      tdc_trig_chan = 7*4; // 28
-   }
-
-   int tdc_trig = 0;
-   for (unsigned int i=0; i<tdc_data->hits.size(); i++) {
-      if (tdc_data->hits[i].trailing) // skip trailing edge hits
-         continue;
-      int chan = tdc_data->hits[i].channel;
-      if (chan != tdc_trig_chan) // skip if not TDC trigger channel
-         continue;
-      tdc_trig = tdc_data->hits[i].measurement;
-      break;
-   }
+   TALOG(TALOG_DEBUG, gLogTdc, "tdc_trig %d\n", hits->fTrigSignal);
 
-   printf("tdc_trig %d\n", tdc_trig);
-
-   fHTdcTrig->Fill(tdc_trig);
-
-   int chan = -1;
-   // Seems to be some noise in the measurements.  In the case of multiple
-   // measurements for the same channel, get the earliest measurement.
-   //    double a1m_earliest = 9999999.0, a2m_earliest = 9999999.0;
-   // Vector of the earliest TDC time for each channel
-   //    std::vector<double> a1_pulse_time(10,-1.0);
-   //    int a1_counter = 0;
-   for(unsigned int i = 0; i < tdc_data->hits.size(); i++){ // loop over measurements
-      if (tdc_data->hits[i].trailing) // skip trailing edge hits
-         continue;
-      chan = tdc_data->hits[i].channel;
-      double t = (tdc_data->hits[i].measurement);//-tdc_trig); //* tdc_bin; // convert to mm
-      if (fHTdcRaw[chan]) {
-         printf("chan %d, time %f\n", chan, t);
-         fHTdcRaw[chan]->Fill(t);
-      }
-      counts[chan] = counts[chan] + 1;
+   fHTdcTrig.Fill(hits->fTrigSignal);
 
+   TAH1I::FillHits(fHTdcRaw, 64, (int)hits->fLeadChannel.size(), hits->fLeadChannel.data(), hits->fLeadTime.data());
 
-
-
-      if (chan==32 && tdchit==2){
-         trf = t;
-      }
-
-      if (chan==32 && tdchit==3){
-         trf_next = t;
-      }
-      printf("chan %i\n", chan);
-      printf("hit %d\n", hit);
-      printf("tdchit %d\n", tdchit);
-
-
-      datum[chan][hit] = t;
-
-      hit++;
-      if (chan==32) {
-         tdchit++;
-      }
-
-      if(t < earliest_times[chan])
-         earliest_times[chan] = t;
-   }
-   //datum[chan][hit] = t;
+   // third and fourth RF hits
+   if (hits->fNumRf > 2)
+      trf = hits->fRf[2];
+   if (hits->fNumRf > 3)
+      trf_next = hits->fRf[3];
 
    // printf("Hits %d\n", hit);
 
    Double_t xsum, xdiff, xpos, ysum, ydiff, ypos;
 
    // Get earliest time for anode (if more than one)
-   anode = 999999.0;
-   for (int j=0; j<3; j++) {
-      if (earliest_times[j*4] < anode)
-         anode = earliest_times[j*4];
-   }
-
-   at = earliest_times[0];
-   am = earliest_times[4];
-   ab = earliest_times[8];
-   xr = earliest_times[12];
-   xl = earliest_times[16];
-   yt = earliest_times[20];
-   yb = earliest_times[24];
-   trig = earliest_times[28];
+   at = hits->Earliest(calib, EMMA_TDC_AT);
+   am = hits->Earliest(calib, EMMA_TDC_AM);
+   ab = hits->Earliest(calib, EMMA_TDC_AB);
+   xr = hits->Earliest(calib, EMMA_TDC_XR);
+   xl = hits->Earliest(calib, EMMA_TDC_XL);
+   yt = hits->Earliest(calib, EMMA_TDC_YT);
+   yb = hits->Earliest(calib, EMMA_TDC_YB);
+   trig = hits->Earliest(calib, EMMA_TDC_TRIG);
+
+   anode = at;
+   if (am < anode)
+      anode = am;
+   if (ab < anode)
+      anode = ab;
 
    //for (int i=0; i<20; i++) {
    //	trf[i] = datum[32][i];
@@ -463,116 +422,148 @@ void EmmaModule::UpdateHistograms(TARunInfo* runinfo, const v1190event* tdc_data
 
    //		trf = datum[32][4];
    if (am<999999) {
-      printf("trf %f\n", trf);
-      printf("anode %f\n", anode);
-   }
-   multi_at = counts[0];
-   multi_am = counts[4];
-   multi_ab = counts[8];
-   multi_xr = counts[12];
-   multi_xl = counts[16];
-   multi_yt = counts[20];
-   multi_yb = counts[24];
-   multi_trig = counts[28];
-
-   printf("Multi %d\n", multi_xr);
-
-   hmulti_at->Fill(multi_at);
-   hmulti_am->Fill(multi_am);
-   hmulti_ab->Fill(multi_ab);
-   hmulti_xr->Fill(multi_xr);
-   hmulti_xl->Fill(multi_xl);
-   hmulti_yt->Fill(multi_yt);
-   hmulti_yb->Fill(multi_yb);
-   hmulti_trig->Fill(multi_trig);
+      TALOG(TALOG_DEBUG, gLogEmma, "trf %f, anode %f\n", trf, anode);
+   }
+   multi_at = hits->Count(calib, EMMA_TDC_AT);
+   multi_am = hits->Count(calib, EMMA_TDC_AM);
+   multi_ab = hits->Count(calib, EMMA_TDC_AB);
+   multi_xr = hits->Count(calib, EMMA_TDC_XR);
+   multi_xl = hits->Count(calib, EMMA_TDC_XL);
+   multi_yt = hits->Count(calib, EMMA_TDC_YT);
+   multi_yb = hits->Count(calib, EMMA_TDC_YB);
+   multi_trig = hits->Count(calib, EMMA_TDC_TRIG);
+
+   TALOG(TALOG_DEBUG, gLogEmma, "Multi %d\n", multi_xr);
+
+   hmulti_at.Fill(multi_at);
+   hmulti_am.Fill(multi_am);
+   hmulti_ab.Fill(multi_ab);
+   hmulti_xr.Fill(multi_xr);
+   hmulti_xl.Fill(multi_xl);
+   hmulti_yt.Fill(multi_yt);
+   hmulti_yb.Fill(multi_yb);
+   hmulti_trig.Fill(multi_trig);
 
    xsum = xl + xr - 2*anode;
-   xdiff = (xl + xloffset) - (xr + xroffset);
-   xpos = 80*(xdiff/xsum);
+   xdiff = (xl + calib->fXlOffset) - (xr + calib->fXrOffset);
+   xpos = calib->fXScale*(xdiff/xsum);
 
    if( xl<999999 && xr<999999 ){
-      x_y_diff[0]->Fill(xdiff*0.0222);
-      x_y_sum[0]->Fill(xsum);
-      hXPosition->Fill(xpos);
+      x_y_diff[0].Fill(xdiff*calib->fXDiffScale);
+      x_y_sum[0].Fill(xsum);
+      hXPosition.Fill(xpos);
    }
 
    ysum = yb + yt - 2*anode;
-   ydiff = (yb + yboffset) - (yt + ytoffset);
-   ypos = 30*(ydiff/ysum);
+   ydiff = (yb + calib->fYbOffset) - (yt + calib->fYtOffset);
+   ypos = calib->fYScale*(ydiff/ysum);
 
    if( yt<999999 && yb<999999 ){
-      x_y_diff[1]->Fill(ydiff*0.0226);
-      x_y_sum[1]->Fill(ysum);
-      hYPosition->Fill(ypos);
+      x_y_diff[1].Fill(ydiff*calib->fYDiffScale);
+      x_y_sum[1].Fill(ysum);
+      hYPosition.Fill(ypos);
    }
 
    if ( xr<999999 && xl<999999 && yb<999999 && yt<999999 ){
-      hXYPosition->Fill(xpos,ypos);
+      hXYPosition.Fill(xpos,ypos);
    }
 
 
    //*******ADC DATA COUNTING***************
    //Make a vector of vectors to have each channel be a dynanmically expanding collection of energies
    //std::vector< std::vector<double> > energy_signals(n_ach, std::vector<double>);
-   std::vector<double> energy_signals(32, 0);
 
-   //for each event in the ADC event structure
-   for (unsigned int i=0; i < adc_data->hits.size(); i++){
+   // raw spectra, overflows go to 4096
+   uint16_t adc_raw[MESADC32_MAX_HITS];
+   for (int i=0; i < adc_data->nhits; i++)
+      adc_raw[i] = adc_data->v[i] ? 4096 : adc_data->adc_data[i];
+   TAH1I::FillHits(fHAdcRaw, 32, adc_data->nhits, adc_data->channel, adc_raw);
 
-      int chan = adc_data->hits[i].channel;
+   EmmaScratch* scratch = fScratch;
+   scratch->Reset();
 
-      if (fHAdcRaw[chan]){
-         if (adc_data->hits[i].v) //If we're overflowing our ADC
-            fHAdcRaw[chan]->Fill(4096);
-         else
-            fHAdcRaw[chan]->Fill(adc_data->hits[i].adc_data);
-      }
+   //for each event in the ADC event structure
+   for (int i=0; i < adc_data->nhits; i++){
 
-      for (int j=0; j < 6; j++){
-         if (ach[j] == chan ) {
-            double energy = 1.0*adc_data->hits[i].adc_data;
+      int chan = adc_data->channel[i];
+      if (chan < 0 || chan >= EMMA_ADC_CHANNELS)
+         continue;
 
-            hADC_used[j]->Fill(energy);
+      int role = calib->fAdcRole[chan];
+      if (role < 0) // not used
+         continue;
 
-            energy_signals[chan] =energy;
+      double energy = 1.0*adc_data->adc_data[i];
 
-         }
-      }//end chan == ADC_used check
+      hADC_used[role].Fill(energy);
+
+      scratch->SetEnergy(chan, energy);
 
    }//end foreach ADC event
 
-   Sienergy = energy_signals[16];
-   ATenergy = energy_signals[0];
-   AMenergy = energy_signals[1];
-   ABenergy = energy_signals[2];
+   Sienergy = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_SI]];
+   ATenergy = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_AT]];
+   AMenergy = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_AM]];
+   ABenergy = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_AB]];
+
+   sbl_ene = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_SBL]];
+   sbr_ene = scratch->fEnergy[calib->fAdcChannel[EMMA_ADC_SBR]];
 
-   sbl_ene = energy_signals[18];
-   sbr_ene = energy_signals[20];
+   bool si_gate = (Sienergy > calib->fSiGateMin && Sienergy < calib->fSiGateMax);
 
-   hSienergy->Fill(Sienergy);
+   hSienergy.Fill(Sienergy);
 
-   if( xl<999999 && xr<999999 && Sienergy>800 && Sienergy<1100){
-      x_y_diff_Gated[0]->Fill(xdiff*0.02);
-      hXPosition_Gated->Fill(xpos);
+   if( xl<999999 && xr<999999 && si_gate){
+      x_y_diff_Gated[0].Fill(xdiff*calib->fGatedDiffScale);
+      hXPosition_Gated.Fill(xpos);
    }
-   if( yt<999999 && yb<999999 && Sienergy>800 && Sienergy<1100){
-      x_y_diff_Gated[1]->Fill(ydiff*0.02);
-      hYPosition_Gated->Fill(ypos);
+   if( yt<999999 && yb<999999 && si_gate){
+      x_y_diff_Gated[1].Fill(ydiff*calib->fGatedDiffScale);
+      hYPosition_Gated.Fill(ypos);
    }
-   if ( xr<999999 && xl<999999 && yb<999999 && yt<999999 && Sienergy>800 && Sienergy<1100 ) {
-      hXYPosition_Gated->Fill(xpos,ypos);
+   if ( xr<999999 && xl<999999 && yb<999999 && yt<999999 && si_gate ) {
+      hXYPosition_Gated.Fill(xpos,ypos);
    }
 
    PGACenergy = ATenergy + ABenergy + AMenergy;
 
-   hdE_E->Fill(Sienergy,PGACenergy);
-
-   hRF->Fill(trf);
-
-   hsbl->Fill(sbl_ene);
-   hsbr->Fill(sbr_ene);
-
-   t1->Fill();
+   hdE_E.Fill(Sienergy,PGACenergy);
+
+   hRF.Fill(trf);
+
+   hsbl.Fill(sbl_ene);
+   hsbr.Fill(sbr_ene);
+
+   if (fOutput) {
+      EmmaSummary s;
+      s.at = at;
+      s.am = am;
+      s.ab = ab;
+      s.anode = anode;
+      s.xl = xl;
+      s.xr = xr;
+      s.yb = yb;
+      s.yt = yt;
+      s.trig = trig;
+      s.ATenergy = ATenergy;
+      s.AMenergy = AMenergy;
+      s.ABenergy = ABenergy;
+      s.PGACenergy = PGACenergy;
+      s.Sienergy = Sienergy;
+      s.trf = trf;
+      s.trf_next = trf_next;
+      s.sbr_ene = sbr_ene;
+      s.sbl_ene = sbl_ene;
+      s.multi_at = multi_at;
+      s.multi_am = multi_am;
+      s.multi_ab = multi_ab;
+      s.multi_xr = multi_xr;
+      s.multi_xl = multi_xl;
+      s.multi_yt = multi_yt;
+      s.multi_yb = multi_yb;
+      s.multi_trig = multi_trig;
+      fOutput->Fill(&s);
+   }
 
    //for (int i=0; i<hit; i++) {
    //              trf[i] = 0;
@@ -582,7 +573,7 @@ void EmmaModule::UpdateHistograms(TARunInfo* runinfo, const v1190event* tdc_data
 
 void EmmaModule::PlotHistograms(TARunInfo* runinfo)
 {
-   printf("PlotHistograms!\n");
+   TALOG(TALOG_DEBUG, gLogEmma, "PlotHistograms!\n");
 
    {
       TCanvas* c1 = fCanvasTdcRaw;
@@ -811,28 +802,33 @@ void EmmaModule::BeginRun(TARunInfo* runinfo)
    time_t run_start_time = runinfo->fOdb->odbReadUint32("/Runinfo/Start time binary", 0, 0);
    printf("ODB Run start time: %d: %s", (int)run_start_time, ctime(&run_start_time));
    fCounter = 0;
+   fTdcDelta.Reset();
+   fAdcDelta.Reset();
+   fEtttDelta.Reset();
+
+   fCalib.SetDefaults();
+   fCalib.ReadOdb(runinfo->fOdb, EMMA_CALIB_ODB);
+   if (!fConfig->fCalibFile.empty()) {
+      if (!fCalib.ReadFile(fConfig->fCalibFile.c_str()))
+         fprintf(stderr, "EmmaModule: errors in calibration file \"%s\", see above\n", fConfig->fCalibFile.c_str());
+   }
+   if (!fCalib.Compile(runinfo->fRunNo)) {
+      fprintf(stderr, "EmmaModule: invalid channel map or calibration, using the defaults\n");
+      fCalib.SetDefaults();
+      fCalib.Compile(runinfo->fRunNo);
+   }
+   fCalib.Print();
+
    runinfo->fRoot->fOutputFile->cd(); // select correct ROOT directory
    //fATX->BeginRun(runinfo->fRunNo);
 
-   t1 = new TTree("t1","TDC Tree");
-   t1->Branch("AnodeTop",&at,"at/D");
-   t1->Branch("AnodeMiddle",&am,"am/D");
-   t1->Branch("AnodeBottow",&ab,"ab/D");
-   t1->Branch("Anode",&anode,"anode/D");
-   t1->Branch("CathodeXleft",&xl,"xl/D");
-   t1->Branch("CathodeXright",&xr,"xr/D");
-   t1->Branch("CathodeYbottom",&yb,"yb/D");
-   t1->Branch("CathodeYtop",&yt,"yt/D");
-   t1->Branch("TDCtrig",&trig,"trig/D");
-   t1->Branch("ATenergy",&ATenergy,"ATenergy/D");
-   t1->Branch("AMenergy",&AMenergy,"AMenergy/D");
-   t1->Branch("ABenergy",&ABenergy,"ABenergy/D");
-   t1->Branch("PGACenergy",&PGACenergy,"PGACenergy/D");
-   t1->Branch("Sienergy",&Sienergy,"Sienergy/D");
-   t1->Branch("trf",&trf,"trf/D");
-   t1->Branch("trf_next",&trf_next,"trf_next/D");
-   t1->Branch("sbr_ene",&sbr_ene,"sbr_ene/D");
-   t1->Branch("sbl_ene",&sbl_ene,"sbl_ene/D");
+   if (fConfig->fOutputType == "columnar") {
+      char fname[1024];
+      sprintf(fname, "emma%05d%s.ecol", runinfo->fRunNo, TARootHelper::fgOutputPart.c_str());
+      fOutput = new EmmaColumnarOutput(fname, runinfo->fRunNo, fConfig->fOutputCompression, fConfig->fOutputBlockEvents);
+   } else {
+      fOutput = new EmmaTreeOutput();
+   }
 
 } //end BeginRun
 
@@ -841,6 +837,9 @@ void EmmaModule::EndRun(TARunInfo* runinfo)
    printf("EndRun, run %d, events %d\n", runinfo->fRunNo, fCounter);
    time_t run_stop_time = runinfo->fOdb->odbReadUint32("/Runinfo/Stop time binary", 0, 0);
    printf("ODB Run stop time: %d: %s", (int)run_stop_time, ctime(&run_stop_time));
+   if (fOutput)
+      fOutput->Close();
+   DELETE(fOutput);
    //fATX->EndRun();
    //char fname[1024];
    //sprintf(fname, "output%05d.pdf", runinfo->fRunNo);
@@ -849,6 +848,32 @@ void EmmaModule::EndRun(TARunInfo* runinfo)
 } //end EndRun
 
 
+TAFlowEvent* EmmaModule::AnalyzeParallel(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow)
+{
+   if (event->event_id != 1)
+      return flow;
+
+   const char* tdc_ptr = NULL;
+   int tdc_len = 0;
+   const char* adc_ptr = NULL;
+   int adc_len = 0;
+
+   TMBank* tb = event->FindBank("EMMT");
+   if (tb) {
+      tdc_ptr = event->GetBankData(tb);
+      tdc_len = tb->data_size;
+   }
+
+   TMBank* ab = event->FindBank("MADC");
+   if (ab) {
+      adc_ptr = event->GetBankData(ab);
+      adc_len = ab->data_size;
+   }
+
+   return Unpack(tdc_ptr, tdc_len, adc_ptr, adc_len, flow);
+
+} // end AnalyzeParallel
+
 TAFlowEvent* EmmaModule::Analyze(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow)
 {
    //printf("Analyze, run %d, event serno %d, id 0x%04x, data size %d\n", runinfo->fRunNo, event->serial_number, (int)event->event_id, event->data_size);
@@ -856,133 +881,169 @@ TAFlowEvent* EmmaModule::Analyze(TARunInfo* runinfo, TMEvent* event, TAFlags* fl
    if (event->event_id != 1)
       return flow;
 
-   v1190event *xte = NULL;
-   mesadc32event *xae = NULL;
+   // banks unpacked by AnalyzeParallel()
+   EmmaUnpackedEvent* ue = flow ? flow->Find<EmmaUnpackedEvent>() : NULL;
+   if (!ue)
+      return flow;
 
-   {
-      TMBank* b = event->FindBank("EMMT");
+   flow = AnalyzeBanks(runinfo, event->serial_number, ue, flow);
 
-      if (b) {
-         int bklen = b->data_size;
-         const char* bkptr = event->GetBankData(b);
+   return flow;
 
-         if (bkptr) {
-            printf("EMMA TDC, pointer: %p, len %d\n", bkptr, bklen);
+} // end Analyze
 
-            while (bklen > 0) {
-               v1190event *te = UnpackV1190(&bkptr, &bklen, fConfig->fVerboseV1190);
-               if (te == NULL)
-                  break;
-               te->Print();
+TAFlowEvent* EmmaModule::AnalyzeView(TARunInfo* runinfo, const TMEventView* event, TAFlags* flags, TAFlowEvent* flow)
+{
+   if (event->event_id != 1)
+      return flow;
 
-               int tdc_offset = 0;
+   const char* tdc_ptr = NULL;
+   int tdc_len = 0;
+   const char* adc_ptr = NULL;
+   int adc_len = 0;
 
-               if (runinfo->fRunNo == 73)
-                  tdc_offset = 0;
+   TMBank tb;
+   if (event->FindBank("EMMT", &tb)) {
+      tdc_ptr = event->GetBankData(&tb);
+      tdc_len = tb.data_size;
+   }
 
-               static int old_ettt = 0;
-               int xettt = (te->ettt)<<5;
-               int xts = xettt*25 + tdc_offset;
+   TMBank ab;
+   if (event->FindBank("MADC", &ab)) {
+      adc_ptr = event->GetBankData(&ab);
+      adc_len = ab.data_size;
+   }
+
+   EmmaUnpackedEvent* ue = Unpack(tdc_ptr, tdc_len, adc_ptr, adc_len, flow);
+   flow = AnalyzeBanks(runinfo, event->serial_number, ue, ue);
 
-               printf("EMMA TDC timestamp %d\n", xettt);
+   return flow;
 
-               printf("EMMA TDC sn %d, delta %5d, ts %d\n", event->serial_number, ((xettt - old_ettt)*25)/800, xts/800);
-               old_ettt = xettt;
+} // end AnalyzeView
 
-               if (0) {
-                  double ts = te->ettt/1.25;
-                  static double prevts = 0;
-                  if (prevts == 0) {
-                     prevts = ts;
-                  } else {
-                     double dt = ts - prevts;
-                     printf("TDC ts %8d, dt %5d\n", (int)ts, (int)dt);
-                     //fHAdcTime->Fill(dt);
-                     prevts = ts;
-                  }
-               }
+EmmaUnpackedEvent* EmmaModule::Unpack(const char* tdc_ptr, int tdc_len, const char* adc_ptr, int adc_len, TAFlowEvent* flow) const
+{
+   // NB: called from the worker threads, nothing here may change the module,
+   // fCalib only changes in BeginRun()
+
+   EmmaUnpackedEvent* ue = new EmmaUnpackedEvent(flow);
+
+   if (tdc_ptr) {
+      int bklen = tdc_len;
+      const char* bkptr = tdc_ptr;
+
+      TALOG(TALOG_DEBUG, gLogTdc, "EMMA TDC, pointer: %p, len %d\n", bkptr, bklen);
+
+      while (bklen > 0) {
+         v1190event *te = UnpackV1190(&bkptr, &bklen, fConfig->fVerboseV1190);
+         if (te == NULL)
+            break;
+         if (TALog::Enabled(TALOG_TRACE, gLogTdc))
+            te->Print();
+         EmmaTdcHits* hits = EmmaTdcHits::New();
+         hits->Reduce(te, &fCalib);
+         ue->fTdc.push_back(te);
+         ue->fTdcHits.push_back(hits);
+      }
+   }
 
-               fHTdcNhits->Fill(te->hits.size());
+   if (adc_ptr) {
+      int bklen = adc_len;
+      const char* bkptr = adc_ptr;
 
-               if (!xte) {
-                  xte = te;
-               } else {
-                  printf("ERROR: DUPLICATE TDC EVENT!\n");
-                  delete te;
-               }
+      TALOG(TALOG_DEBUG, gLogAdc, "EMMA MADC, pointer: %p, len %d\n", bkptr, bklen);
 
-            }
-         }
+      while (bklen > 0) {
+         ue->fAdc.push_back(EmmaAdcFragment());
+         EmmaAdcFragment* af = &ue->fAdc.back();
+         af->fResult = fDecodeAdc(&bkptr, &bklen, &af->fHits);
+         if (TALog::Enabled(TALOG_TRACE, gLogAdc))
+            af->GetResult()->Print();
       }
    }
 
-   {
-      TMBank* b = event->FindBank("MADC");
-
-      if (b) {
-         int bklen = b->data_size;
-         const char* bkptr = event->GetBankData(b);
-
-         if (bkptr) {
-            printf("EMMA MADC, pointer: %p, len %d\n", bkptr, bklen);
-
-            while (bklen > 0) {
-               mesadc32event *ae = UnpackMesadc32(&bkptr, &bklen, fConfig->fVerboseMesadc32);
-               if (ae == NULL)
-                  break;
-               ae->Print();
-
-               fHAdcNhits->Fill(ae->hits.size());
-
-               if (0) {
-                  static int prevts = 0;
-                  if (prevts == 0) {
-                     prevts = ae->time_stamp;
-                  } else {
-                     int ts = ae->time_stamp;
-                     int dt = ts - prevts;
-                     printf("ts %8d, dt %5d\n", ts, dt);
-                     //fHAdcTime->Fill(dt);
-                     prevts = ts;
-                  }
-               }
-
-               if (!xae) {
-                  xae = ae;
-               } else {
-                  printf("ERROR: DUPLICATE ADC EVENT!\n");
-                  delete ae;
-               }
-            }
-         }
-      }
+   return ue;
+
+} // end Unpack
+
+TAFlowEvent* EmmaModule::AnalyzeBanks(TARunInfo* runinfo, int serial_number, EmmaUnpackedEvent* ue, TAFlowEvent* flow)
+{
+   for (unsigned i=0; i<ue->fTdc.size(); i++) {
+      v1190event *te = ue->fTdc[i];
+      EmmaTdcHits* hits = ue->fTdcHits[i];
+      ue->fTdc[i] = NULL; // owned by the event builder
+      ue->fTdcHits[i] = NULL;
+
+      int tdc_offset = 0;
+
+      if (runinfo->fRunNo == 73)
+         tdc_offset = 0;
+
+      int xettt = (te->ettt)<<5;
+      int xts = xettt*25 + tdc_offset;
+      int delta = fEtttDelta.Delta(xettt);
+
+      TALOG(TALOG_DEBUG, gLogTdc, "EMMA TDC timestamp %d\n", xettt);
+
+      TALOG(TALOG_DEBUG, gLogTdc, "EMMA TDC sn %d, delta %5d, ts %d\n", serial_number, (delta*25)/800, xts/800);
+
+      fHTdcNhits.Fill(te->hits.size());
+
+      fBuilder.AddTdc(te, hits);
    }
 
-   if (xte && xae) {
-      UpdateHistograms(runinfo, xte, xae);
-   } else {
-      printf("ERROR: ADC and TDC event mismatch: %p %p\n", xte, xae);
+   for (unsigned i=0; i<ue->fAdc.size(); i++) {
+      const mesadc32result *ae = ue->fAdc[i].GetResult();
+
+      fHAdcNhits.Fill(ae->nhits);
+
+      fBuilder.AddAdc(ae);
    }
 
-   if (xte)
-      delete xte;
-   if (xae)
-      delete xae;
+   // matched ADC and TDC events go to AnalyzeFlowEvent()
+   flow = fBuilder.Build(flow, false);
+
+   // canvases are redrawn by RefreshDisplay(), not from here
 
-   static time_t t = 0;
+   fCounter++;
+
+   return flow;
 
-   time_t now = time(NULL);
+} // end AnalyzeBanks
 
-   if (now - t > 15) {
-      t = now;
-      PlotHistograms(runinfo);
+TAFlowEvent* EmmaModule::AnalyzeFlowEvent(TARunInfo* runinfo, TAFlags* flags, TAFlowEvent* flow)
+{
+   // the built events are chained newest first
+   std::vector<EmmaBuiltEvent*> events;
+   for (TAFlowEvent* f = flow; f; f = f->fNext) {
+      EmmaBuiltEvent* e = dynamic_cast<EmmaBuiltEvent*>(f);
+      if (e)
+         events.push_back(e);
    }
 
-   fCounter++;
+   for (int i=(int)events.size()-1; i>=0; i--) {
+      EmmaTdcSummary* tdc = new EmmaTdcSummary(flow);
+      tdc->fEvent = events[i];
+      tdc->fHits = events[i]->fTdcHits; // reduced by Unpack()
+      tdc->fTdcTime = events[i]->fTdcTime;
+      flow = tdc;
+
+      UpdateHistograms(runinfo, tdc, events[i]->fAdc.GetResult(), events[i]->fAdcTime);
+   }
 
    return flow;
 
-} // end Analyze
+} // end AnalyzeFlowEvent
+
+void EmmaModule::PreEndRun(TARunInfo* runinfo, std::deque<TAFlowEvent*>* flow_queue)
+{
+   TAFlowEvent* flow = fBuilder.Build(NULL, true);
+   if (flow)
+      flow_queue->push_back(flow);
+
+   fBuilder.Print();
+
+} // end PreEndRun
 
 void EmmaModule::AnalyzeSpecialEvent(TARunInfo* runinfo, TMEvent* event)
 {
@@ -998,11 +1059,82 @@ void EmmaModuleFactory::Init(const std::vector<std::string> &args)
    for (unsigned i=0; i<args.size(); i++) {
       if (args[i] == "--verbose-v1190")
          fConfig->fVerboseV1190 = true;
+      if (args[i] == "--verbose-mesadc32")
+         fConfig->fVerboseMesadc32 = true;
+      if (args[i] == "--strict-mesadc32")
+         fConfig->fStrictMesadc32 = true;
+      if (args[i] == "--output=tree")
+         fConfig->fOutputType = "tree";
+      if (args[i] == "--output=columnar")
+         fConfig->fOutputType = "columnar";
+      if (args[i].find("--output-compression=") == 0) {
+         fConfig->fOutputCompression = EmmaOutput::ParseCompression(args[i].c_str() + 21);
+         if (fConfig->fOutputCompression < 0) {
+            fprintf(stderr, "EmmaModule: invalid or not compiled in compression in \"%s\", should be none, lz4 or zstd\n", args[i].c_str());
+            exit(1);
+         }
+      }
+      if (args[i].find("--build-window=") == 0)
+         fConfig->fBuildWindowUs = atof(args[i].c_str() + 15);
+      if (args[i].find("--build-depth=") == 0)
+         fConfig->fBuildDepth = atoi(args[i].c_str() + 14);
+      if (args[i].find("--adc-tick=") == 0)
+         fConfig->fAdcTickUs = atof(args[i].c_str() + 11);
+      if (args[i].find("--calib=") == 0)
+         fConfig->fCalibFile = args[i].c_str() + 8;
+      if (args[i].find("--output-block=") == 0) {
+         fConfig->fOutputBlockEvents = atoi(args[i].c_str() + 15);
+         if (fConfig->fOutputBlockEvents < 1)
+            fConfig->fOutputBlockEvents = 1;
+      }
    }
 
    TARootHelper::fgDir->cd(); // select correct ROOT directory
 }
 
+int EmmaModuleFactory::MergeParallel(const char* part)
+{
+   // columnar output of the -j workers, emma<run>.part<tag>-<index>.ecol,
+   // in file order into emma<run>.ecol
+
+   char pattern[256];
+   sprintf(pattern, "emma*%s*.ecol", part);
+
+   glob_t g;
+   if (glob(pattern, 0, NULL, &g) != 0)
+      return 0;
+
+   std::map<int, std::vector<std::string> > parts;
+
+   for (size_t i=0; i<g.gl_pathc; i++) {
+      int runno = 0;
+      if (sscanf(g.gl_pathv[i], "emma%d.part", &runno) == 1)
+         parts[runno].push_back(g.gl_pathv[i]);
+   }
+
+   globfree(&g);
+
+   int errors = 0;
+
+   for (std::map<int, std::vector<std::string> >::iterator it = parts.begin(); it != parts.end(); it++) {
+      char fname[1024];
+      sprintf(fname, "emma%05d.ecol", it->first);
+
+      printf("Merging %d worker columnar files into %s\n", (int)it->second.size(), fname);
+
+      if (!EmmaColumnarOutput::Concatenate(fname, it->second)) {
+         fprintf(stderr, "EmmaModule: cannot merge worker columnar files into %s, keeping the worker files\n", fname);
+         errors++;
+         continue;
+      }
+
+      for (unsigned i=0; i<it->second.size(); i++)
+         unlink(it->second[i].c_str());
+   }
+
+   return errors;
+}
+
 TARunObject* EmmaModuleFactory::NewRunObject(TARunInfo* runinfo)
 {
    printf("NewRun, run %d, file %s\n", runinfo->fRunNo, runinfo->fFileName.c_str());
@@ -0,0 +1,524 @@
+// emma_output.cxx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "emma_output.h"
+#include "talog.h"
+
+static unsigned gLogOutput = TALog::Category("emma.output");
+
+// columns of the columnar output, in file order
+
+struct EmmaColumnDef
+{
+   const char* fName;
+   int fType; // EMMACOL_xxx
+   size_t fOffset; // in EmmaSummary
+};
+
+#define EMMACOL_F(x) { #x, EMMACOL_FLOAT32, offsetof(EmmaSummary, x) }
+#define EMMACOL_I(x) { #x, EMMACOL_INT16, offsetof(EmmaSummary, x) }
+
+// times are TDC counts and energies are ADC counts, both are exact in float32
+
+static const EmmaColumnDef gColumns[] = {
+   EMMACOL_F(at),
+   EMMACOL_F(am),
+   EMMACOL_F(ab),
+   EMMACOL_F(anode),
+   EMMACOL_F(xl),
+   EMMACOL_F(xr),
+   EMMACOL_F(yb),
+   EMMACOL_F(yt),
+   EMMACOL_F(trig),
+   EMMACOL_F(ATenergy),
+   EMMACOL_F(AMenergy),
+   EMMACOL_F(ABenergy),
+   EMMACOL_F(PGACenergy),
+   EMMACOL_F(Sienergy),
+   EMMACOL_F(trf),
+   EMMACOL_F(trf_next),
+   EMMACOL_F(sbr_ene),
+   EMMACOL_F(sbl_ene),
+   EMMACOL_I(multi_at),
+   EMMACOL_I(multi_am),
+   EMMACOL_I(multi_ab),
+   EMMACOL_I(multi_xr),
+   EMMACOL_I(multi_xl),
+   EMMACOL_I(multi_yt),
+   EMMACOL_I(multi_yb),
+   EMMACOL_I(multi_trig),
+};
+
+static const int gNumColumns = sizeof(gColumns)/sizeof(gColumns[0]);
+
+static int ColumnSize(int type)
+{
+   return (type == EMMACOL_INT16) ? 2 : 4;
+}
+
+static size_t Pad8(size_t size)
+{
+   return (size + 7) & ~(size_t)7;
+}
+
+struct EmmaColFileHeader
+{
+   char     magic[8];
+   uint32_t version;
+   uint32_t ncolumns;
+   uint32_t runno;
+   uint32_t zero;
+};
+
+struct EmmaColColumnHeader
+{
+   char     name[24];
+   uint32_t type;
+   uint32_t size;
+};
+
+struct EmmaColBlockHeader
+{
+   char     magic[4];
+   uint32_t compression;
+   uint32_t nevents;
+   uint32_t zero;
+   uint64_t data_size;
+   uint64_t stored_size;
+};
+
+int EmmaOutput::ParseCompression(const char* s)
+{
+   if (strcmp(s, "none") == 0)
+      return EMMACOL_COMPRESS_NONE;
+#ifdef HAVE_LZ4
+   if (strcmp(s, "lz4") == 0)
+      return EMMACOL_COMPRESS_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+   if (strcmp(s, "zstd") == 0)
+      return EMMACOL_COMPRESS_ZSTD;
+#endif
+   return -1;
+}
+
+// ==================== TTree output ==================== //
+
+EmmaTreeOutput::EmmaTreeOutput() // ctor
+{
+   fTree = new TTree("t1","TDC Tree");
+   fTree->Branch("AnodeTop",&fData.at,"at/D");
+   fTree->Branch("AnodeMiddle",&fData.am,"am/D");
+   fTree->Branch("AnodeBottow",&fData.ab,"ab/D");
+   fTree->Branch("Anode",&fData.anode,"anode/D");
+   fTree->Branch("CathodeXleft",&fData.xl,"xl/D");
+   fTree->Branch("CathodeXright",&fData.xr,"xr/D");
+   fTree->Branch("CathodeYbottom",&fData.yb,"yb/D");
+   fTree->Branch("CathodeYtop",&fData.yt,"yt/D");
+   fTree->Branch("TDCtrig",&fData.trig,"trig/D");
+   fTree->Branch("ATenergy",&fData.ATenergy,"ATenergy/D");
+   fTree->Branch("AMenergy",&fData.AMenergy,"AMenergy/D");
+   fTree->Branch("ABenergy",&fData.ABenergy,"ABenergy/D");
+   fTree->Branch("PGACenergy",&fData.PGACenergy,"PGACenergy/D");
+   fTree->Branch("Sienergy",&fData.Sienergy,"Sienergy/D");
+   fTree->Branch("trf",&fData.trf,"trf/D");
+   fTree->Branch("trf_next",&fData.trf_next,"trf_next/D");
+   fTree->Branch("sbr_ene",&fData.sbr_ene,"sbr_ene/D");
+   fTree->Branch("sbl_ene",&fData.sbl_ene,"sbl_ene/D");
+}
+
+void EmmaTreeOutput::Fill(const EmmaSummary* s)
+{
+   fData = *s;
+   fTree->Fill();
+}
+
+// ==================== columnar output ==================== //
+
+EmmaColumnarOutput::EmmaColumnarOutput(const char* filename, int runno, int compression, int block_events) // ctor
+{
+   fFilename = filename;
+   fError = false;
+   fCompression = compression;
+   fBlockEvents = block_events;
+   fNevents = 0;
+
+   fColumns.resize(gNumColumns);
+   for (int i=0; i<gNumColumns; i++)
+      fColumns[i].resize(Pad8(fBlockEvents*ColumnSize(gColumns[i].fType)));
+
+   fFile = fopen(filename, "w");
+   if (!fFile) {
+      TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot write \"%s\", fopen() errno %d (%s)\n", filename, errno, strerror(errno));
+      fError = true;
+      return;
+   }
+
+   printf("EmmaColumnarOutput: writing \"%s\", %d events per block, compression %d\n", filename, fBlockEvents, fCompression);
+
+   EmmaColFileHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, "EMMACOL1", 8);
+   h.version = 1;
+   h.ncolumns = gNumColumns;
+   h.runno = runno;
+   Write(&h, sizeof(h));
+
+   for (int i=0; i<gNumColumns; i++) {
+      EmmaColColumnHeader c;
+      memset(&c, 0, sizeof(c));
+      strncpy(c.name, gColumns[i].fName, sizeof(c.name) - 1);
+      c.type = gColumns[i].fType;
+      c.size = ColumnSize(gColumns[i].fType);
+      Write(&c, sizeof(c));
+   }
+}
+
+EmmaColumnarOutput::~EmmaColumnarOutput() // dtor
+{
+   Close();
+}
+
+void EmmaColumnarOutput::Fill(const EmmaSummary* s)
+{
+   const char* src = (const char*)s;
+   for (int i=0; i<gNumColumns; i++) {
+      const EmmaColumnDef* c = &gColumns[i];
+      if (c->fType == EMMACOL_FLOAT32) {
+         float v = *(const double*)(src + c->fOffset);
+         memcpy(&fColumns[i][fNevents*sizeof(float)], &v, sizeof(v));
+      } else {
+         int x = *(const int*)(src + c->fOffset);
+         int16_t v = (x > INT16_MAX) ? INT16_MAX : x;
+         memcpy(&fColumns[i][fNevents*sizeof(int16_t)], &v, sizeof(v));
+      }
+   }
+
+   fNevents++;
+   if (fNevents >= fBlockEvents)
+      WriteBlock();
+}
+
+void EmmaColumnarOutput::Write(const void* ptr, size_t size)
+{
+   if (fError || !fFile)
+      return;
+   size_t wr = fwrite(ptr, 1, size, fFile);
+   if (wr != size) {
+      TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot write \"%s\", fwrite() errno %d (%s)\n", fFilename.c_str(), errno, strerror(errno));
+      fError = true;
+   }
+}
+
+void EmmaColumnarOutput::WriteBlock()
+{
+   if (fNevents == 0)
+      return;
+
+   fData.clear();
+   for (int i=0; i<gNumColumns; i++) {
+      size_t size = Pad8(fNevents*ColumnSize(gColumns[i].fType));
+      fData.insert(fData.end(), fColumns[i].begin(), fColumns[i].begin() + size);
+   }
+
+   EmmaColBlockHeader h;
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, "EBLK", 4);
+   h.compression = EMMACOL_COMPRESS_NONE;
+   h.nevents = fNevents;
+   h.data_size = fData.size();
+   h.stored_size = fData.size();
+
+   const char* stored = fData.data();
+
+#ifdef HAVE_LZ4
+   if (fCompression == EMMACOL_COMPRESS_LZ4) {
+      fPacked.resize(LZ4_compressBound(fData.size()));
+      int size = LZ4_compress_default(fData.data(), fPacked.data(), fData.size(), fPacked.size());
+      if (size > 0 && (size_t)size < fData.size()) {
+         h.compression = EMMACOL_COMPRESS_LZ4;
+         h.stored_size = size;
+         stored = fPacked.data();
+      }
+   }
+#endif
+
+#ifdef HAVE_ZSTD
+   if (fCompression == EMMACOL_COMPRESS_ZSTD) {
+      fPacked.resize(ZSTD_compressBound(fData.size()));
+      size_t size = ZSTD_compress(fPacked.data(), fPacked.size(), fData.data(), fData.size(), 3);
+      if (!ZSTD_isError(size) && size < fData.size()) {
+         h.compression = EMMACOL_COMPRESS_ZSTD;
+         h.stored_size = size;
+         stored = fPacked.data();
+      }
+   }
+#endif
+
+   static const char zero[8] = { 0 };
+
+   Write(&h, sizeof(h));
+   Write(stored, h.stored_size);
+   Write(zero, Pad8(h.stored_size) - h.stored_size);
+
+   fNevents = 0;
+}
+
+void EmmaColumnarOutput::Close()
+{
+   if (!fFile)
+      return;
+
+   WriteBlock();
+
+   if (fclose(fFile) != 0 && !fError)
+      TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot write \"%s\", fclose() errno %d (%s)\n", fFilename.c_str(), errno, strerror(errno));
+   fFile = NULL;
+}
+
+// read the file and column headers, false if this is not a columnar file
+
+static bool ReadHeaders(FILE* fp, std::vector<char>* headers)
+{
+   EmmaColFileHeader h;
+   if (fread(&h, sizeof(h), 1, fp) != 1)
+      return false;
+   if (memcmp(h.magic, "EMMACOL1", 8) != 0 || h.version != 1)
+      return false;
+
+   headers->resize(sizeof(h) + h.ncolumns*sizeof(EmmaColColumnHeader));
+   memcpy(headers->data(), &h, sizeof(h));
+   size_t size = headers->size() - sizeof(h);
+   return fread(headers->data() + sizeof(h), 1, size, fp) == size;
+}
+
+bool EmmaColumnarOutput::Concatenate(const char* filename, const std::vector<std::string>& parts)
+{
+   FILE* out = fopen(filename, "w");
+   if (!out) {
+      TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot write \"%s\", fopen() errno %d (%s)\n", filename, errno, strerror(errno));
+      return false;
+   }
+
+   bool ok = true;
+   std::vector<char> first;
+   std::vector<char> headers;
+   std::vector<char> buf(1024*1024);
+
+   for (unsigned i=0; ok && i<parts.size(); i++) {
+      FILE* fp = fopen(parts[i].c_str(), "r");
+      if (!fp) {
+         TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot read \"%s\", fopen() errno %d (%s)\n", parts[i].c_str(), errno, strerror(errno));
+         ok = false;
+         break;
+      }
+
+      if (!ReadHeaders(fp, &headers)) {
+         TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: \"%s\" is not an EMMA columnar file\n", parts[i].c_str());
+         ok = false;
+      } else if (i == 0) {
+         first = headers;
+         ok = fwrite(first.data(), 1, first.size(), out) == first.size();
+      } else if (headers != first) {
+         TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: \"%s\" has other columns or another run number than \"%s\"\n", parts[i].c_str(), parts[0].c_str());
+         ok = false;
+      }
+
+      // the blocks follow the headers up to EOF
+      while (ok) {
+         size_t rd = fread(buf.data(), 1, buf.size(), fp);
+         if (rd == 0)
+            break;
+         ok = fwrite(buf.data(), 1, rd, out) == rd;
+      }
+
+      if (ferror(fp)) {
+         TALOG(TALOG_ERROR, gLogOutput, "EmmaColumnarOutput: cannot read \"%s\", errno %d (%s)\n", parts[i].c_str(), errno, strerror(errno));
+         ok = false;
+      }
+
+      fclose(fp);
+   }
+
+   if (fclose(out) != 0)
+      ok = false;
+
+   if (!ok)
+      unlink(filename);
+
+   return ok;
+}
+
+// ==================== columnar reader ==================== //
+
+EmmaColumnarReader::EmmaColumnarReader(const char* filename) // ctor
+{
+   fFilename = filename;
+   fError = false;
+   fRunNo = 0;
+   fMap = NULL;
+   fSize = 0;
+   fPos = 0;
+   fNevents = 0;
+
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      fError = true;
+      fErrorString = std::string("open() error: ") + strerror(errno);
+      return;
+   }
+
+   struct stat st;
+   if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+         fMap = (const char*)ptr;
+         fSize = st.st_size;
+      }
+   }
+
+   close(fd);
+
+   if (!fMap) {
+      fError = true;
+      fErrorString = "cannot mmap() the file";
+      return;
+   }
+
+   EmmaColFileHeader h;
+   if (fSize < sizeof(h)) {
+      fError = true;
+      fErrorString = "file is too short";
+      return;
+   }
+
+   memcpy(&h, fMap, sizeof(h));
+   if (memcmp(h.magic, "EMMACOL1", 8) != 0 || h.version != 1) {
+      fError = true;
+      fErrorString = "not an EMMA columnar file";
+      return;
+   }
+
+   fRunNo = h.runno;
+   fPos = sizeof(h);
+
+   if (fPos + h.ncolumns*sizeof(EmmaColColumnHeader) > fSize) {
+      fError = true;
+      fErrorString = "truncated file header";
+      return;
+   }
+
+   for (unsigned i=0; i<h.ncolumns; i++) {
+      EmmaColColumnHeader c;
+      memcpy(&c, fMap + fPos, sizeof(c));
+      fPos += sizeof(c);
+
+      Column col;
+      col.fName = std::string(c.name, strnlen(c.name, sizeof(c.name)));
+      col.fType = c.type;
+      col.fSize = c.size;
+      fColumns.push_back(col);
+   }
+
+   fColumnData.resize(fColumns.size(), NULL);
+}
+
+EmmaColumnarReader::~EmmaColumnarReader() // dtor
+{
+   if (fMap)
+      munmap((void*)fMap, fSize);
+   fMap = NULL;
+}
+
+int EmmaColumnarReader::FindColumn(const char* name) const
+{
+   for (unsigned i=0; i<fColumns.size(); i++)
+      if (fColumns[i].fName == name)
+         return i;
+   return -1;
+}
+
+bool EmmaColumnarReader::NextBlock()
+{
+   fNevents = 0;
+
+   if (fError || fPos + sizeof(EmmaColBlockHeader) > fSize)
+      return false;
+
+   EmmaColBlockHeader h;
+   memcpy(&h, fMap + fPos, sizeof(h));
+
+   if (memcmp(h.magic, "EBLK", 4) != 0 || fPos + sizeof(h) + h.stored_size > fSize) {
+      fError = true;
+      fErrorString = "corrupted or truncated block";
+      return false;
+   }
+
+   const char* stored = fMap + fPos + sizeof(h);
+   const char* data = NULL;
+
+   if (h.compression == EMMACOL_COMPRESS_NONE) {
+      data = stored;
+#ifdef HAVE_LZ4
+   } else if (h.compression == EMMACOL_COMPRESS_LZ4) {
+      fUnpacked.resize(h.data_size);
+      int size = LZ4_decompress_safe(stored, fUnpacked.data(), h.stored_size, h.data_size);
+      if (size == (int)h.data_size)
+         data = fUnpacked.data();
+#endif
+#ifdef HAVE_ZSTD
+   } else if (h.compression == EMMACOL_COMPRESS_ZSTD) {
+      fUnpacked.resize(h.data_size);
+      size_t size = ZSTD_decompress(fUnpacked.data(), h.data_size, stored, h.stored_size);
+      if (size == h.data_size)
+         data = fUnpacked.data();
+#endif
+   }
+
+   if (!data) {
+      fError = true;
+      fErrorString = "cannot decompress block";
+      return false;
+   }
+
+   size_t offset = 0;
+   for (unsigned i=0; i<fColumns.size(); i++) {
+      fColumnData[i] = data + offset;
+      offset += Pad8((size_t)h.nevents*fColumns[i].fSize);
+   }
+
+   if (offset > h.data_size) {
+      fError = true;
+      fErrorString = "block is too short for its columns";
+      return false;
+   }
+
+   fNevents = h.nevents;
+   fPos += sizeof(h) + Pad8(h.stored_size);
+   return true;
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,124 @@
+// emma_tdc.cxx
+
+#include <stdio.h>
+
+#include "emma_tdc.h"
+#include "v1190unpack.h"
+
+static unsigned gLogTdc = TALog::Category("emma.tdc");
+
+EmmaTdcHits::FreeList EmmaTdcHits::fgFree;
+
+EmmaTdcHits::FreeList::~FreeList() // dtor
+{
+   for (unsigned i=0; i<fHits.size(); i++)
+      delete fHits[i];
+   fHits.clear();
+}
+
+EmmaTdcHits::EmmaTdcHits() // ctor
+{
+   Reset();
+}
+
+EmmaTdcHits* EmmaTdcHits::New()
+{
+   EmmaTdcHits* h = NULL;
+
+   {
+      std::lock_guard<std::mutex> lock(fgFree.fMutex);
+      if (!fgFree.fHits.empty()) {
+         h = fgFree.fHits.back();
+         fgFree.fHits.pop_back();
+      }
+   }
+
+   if (!h)
+      return new EmmaTdcHits;
+
+   h->Reset();
+   return h;
+}
+
+void EmmaTdcHits::Delete(EmmaTdcHits* h)
+{
+   if (!h)
+      return;
+   std::lock_guard<std::mutex> lock(fgFree.fMutex);
+   fgFree.fHits.push_back(h);
+}
+
+void EmmaTdcHits::Reset()
+{
+   fTrigSignal = 0;
+   fNumIgnored = 0;
+   fLeadChannel.clear(); // keeps the memory
+   fLeadTime.clear();
+   for (int i=0; i<EMMA_TDC_CHANNELS; i++) {
+      fEarliest[i] = EMMA_NO_TIME;
+      fCounts[i] = 0;
+   }
+   fNumRf = 0;
+}
+
+void EmmaTdcHits::Reduce(const v1190event* tdc, const EmmaCalib* calib)
+{
+   int trig_chan = calib->fTdcTrigChannel;
+   bool have_trig = false;
+
+   unsigned nhits = tdc->hits.size();
+   fLeadChannel.reserve(nhits);
+   fLeadTime.reserve(nhits);
+
+   for (unsigned i=0; i<nhits; i++) {
+      if (tdc->hits[i].trailing) // skip trailing edge hits
+         continue;
+
+      int chan = tdc->hits[i].channel;
+      int m = tdc->hits[i].measurement;
+
+      TALOG(TALOG_TRACE, gLogTdc, "chan %d, time %d\n", chan, m);
+
+      if (chan == trig_chan && !have_trig) {
+         fTrigSignal = m;
+         have_trig = true;
+      }
+
+      if (chan < 0 || chan >= EMMA_TDC_CHANNELS) {
+         TALOG(TALOG_WARNING, gLogTdc, "TDC channel %d out of range, hit ignored\n", chan);
+         fNumIgnored++;
+         continue;
+      }
+
+      fLeadChannel.push_back(chan);
+      fLeadTime.push_back(m);
+
+      double t = m;
+      fCounts[chan]++;
+      if (t < fEarliest[chan])
+         fEarliest[chan] = t;
+
+      if (calib->fTdcRole[chan] == EMMA_TDC_RF) {
+         if (fNumRf < EMMA_TDC_RF_HITS)
+            fRf[fNumRf] = t;
+         fNumRf++;
+      }
+   }
+}
+
+EmmaTdcSummary::EmmaTdcSummary(TAFlowEvent* flow) // ctor
+   : TAFlowEvent(flow)
+{
+   fEvent = NULL;
+   fHits = NULL;
+   fTdcTime = 0;
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
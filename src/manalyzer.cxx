@@ -8,9 +8,34 @@
 #include "manalyzer.h"
 #include "midasio.h"
 
+#include <errno.h>
+#include <unistd.h> // fork(), unlink()
+#include <sys/wait.h> // wait()
+#include <glob.h> // glob()
+#include <map>
+#include <algorithm> // std::remove()
+#include <typeinfo>
+#include <new> // std::bad_alloc
+#include <cxxabi.h> // abi::__cxa_demangle()
+#include <malloc.h> // mallinfo2()
+
+#ifdef HAVE_ROOT
+#include "TFileMerger.h"
+#endif
+
 //////////////////////////////////////////////////////////
 
 static bool gTrace = false;
+static bool gMultithread = false;
+static int  gMtMaxBacklog = 100;
+static int  gWorkers = 0; // --workers, threads of the TAWorkPool
+static int  gWorkBatch = 16; // --workbatch, events per batch given to a worker
+static int  gBatchSize = 0; // --batch, events per RunHandler::AnalyzeBatch(), 0 for event by event
+static int  gReadAheadDepth = 0;
+static int  gWriteBufferMB = 64; // -o output queued for the writer thread, 0 to write synchronously
+static bool gMmap = false;
+static uint32_t gSkipToSerial = 0;
+static double gRefreshInterval = 15; // seconds between display refreshes
 
 //////////////////////////////////////////////////////////
 //
@@ -56,11 +81,65 @@ TARunInfo::~TARunInfo()
 //
 //////////////////////////////////////////////////////////
 
+int TAFlowTypeId::Next()
+{
+   static std::atomic<int> gNext(0);
+   return gNext++;
+}
+
+// flow event memory starts with this header, it says where the memory came from
+
+#define TAFLOW_HEADER 16 // keeps the 16 byte alignment of the arena and of malloc()
+
+void* TAFlowEvent::Alloc(size_t size)
+{
+   TAArena* arena = TAArena::GetCurrent();
+   char* p;
+   if (arena) {
+      p = (char*)arena->Alloc(size + TAFLOW_HEADER, 16);
+   } else {
+      p = (char*)malloc(size + TAFLOW_HEADER);
+      if (!p)
+         throw std::bad_alloc();
+   }
+   *(bool*)p = (arena != NULL);
+   return p + TAFLOW_HEADER;
+}
+
+void TAFlowEvent::Free(void* ptr)
+{
+   if (!ptr)
+      return;
+   char* p = (char*)ptr - TAFLOW_HEADER;
+   if (!*(bool*)p) // memory in the arena is released by TAArena::Reset()
+      free(p);
+}
+
+void* TAFlowEvent::operator new(size_t size)
+{
+   return Alloc(size);
+}
+
+void TAFlowEvent::operator delete(void* ptr)
+{
+   Free(ptr);
+}
+
 TAFlowEvent::TAFlowEvent(TAFlowEvent* flow) // ctor
 {
    if (gTrace)
       printf("TAFlowEvent::ctor: chain %p\n", flow);
    fNext = flow;
+   if (flow && flow->fRegistry) {
+      fRegistry = flow->fRegistry;
+      fOwnRegistry = false;
+   } else {
+      fRegistry = new (Alloc(sizeof(TAFlowRegistry))) TAFlowRegistry;
+      fRegistry->fNextSeq = 1;
+      fRegistry->fNumEntries = 0;
+      fOwnRegistry = true;
+   }
+   fSeq = fRegistry->fNextSeq++;
 }
 
 TAFlowEvent::~TAFlowEvent() // dtor
@@ -70,6 +149,9 @@ TAFlowEvent::~TAFlowEvent() // dtor
    if (fNext)
       delete fNext;
    fNext = NULL;
+   if (fOwnRegistry)
+      Free(fRegistry);
+   fRegistry = NULL;
 }
 
 //////////////////////////////////////////////////////////
@@ -82,6 +164,9 @@ TARunObject::TARunObject(TARunInfo* runinfo)
 {
    if (gTrace)
       printf("TARunObject::ctor, run %d\n", runinfo->fRunNo);
+   fEventView = false;
+   fParallel = false;
+   fBatch = false;
 }
 
 void TARunObject::BeginRun(TARunInfo* runinfo)
@@ -127,6 +212,13 @@ TAFlowEvent* TARunObject::Analyze(TARunInfo* runinfo, TMEvent* event, TAFlags* f
    return flow;
 }
 
+TAFlowEvent* TARunObject::AnalyzeView(TARunInfo* runinfo, const TMEventView* event, TAFlags* flags, TAFlowEvent* flow)
+{
+   if (gTrace)
+      printf("TARunObject::AnalyzeView!\n");
+   return flow;
+}
+
 TAFlowEvent* TARunObject::AnalyzeFlowEvent(TARunInfo* runinfo, TAFlags* flags, TAFlowEvent* flow)
 {
    if (gTrace)
@@ -134,12 +226,34 @@ TAFlowEvent* TARunObject::AnalyzeFlowEvent(TARunInfo* runinfo, TAFlags* flags, T
    return flow;
 }
 
+TAFlowEvent* TARunObject::AnalyzeParallel(TARunInfo* runinfo, TMEvent* event, TAFlags* flags, TAFlowEvent* flow)
+{
+   if (gTrace)
+      printf("TARunObject::AnalyzeParallel!\n");
+   return flow;
+}
+
+void TARunObject::AnalyzeBatch(TARunInfo* runinfo, TMEvent** events, int n, TAFlags* flags, TAFlowEvent** flows)
+{
+   if (gTrace)
+      printf("TARunObject::AnalyzeBatch, %d events\n", n);
+   for (int i=0; i<n; i++)
+      if (!(flags[i] & TAFlag_SKIP))
+         flows[i] = Analyze(runinfo, events[i], &flags[i], flows[i]);
+}
+
 void TARunObject::AnalyzeSpecialEvent(TARunInfo* runinfo, TMEvent* event)
 {
    if (gTrace)
       printf("TARunObject::AnalyzeSpecialEvent!\n");
 }
 
+void TARunObject::RefreshDisplay(TARunInfo* runinfo)
+{
+   if (gTrace)
+      printf("TARunObject::RefreshDisplay!\n");
+}
+
 //////////////////////////////////////////////////////////
 //
 // Methods of TAFactory
@@ -158,6 +272,13 @@ void TAFactory::Finish()
       printf("TAFactory::Finish!\n");
 }
 
+int TAFactory::MergeParallel(const char* part)
+{
+   if (gTrace)
+      printf("TAFactory::MergeParallel, part \"%s\"\n", part);
+   return 0;
+}
+
 
 //////////////////////////////////////////////////////////
 //
@@ -166,6 +287,8 @@ void TAFactory::Finish()
 //////////////////////////////////////////////////////////
 
 
+std::string   TARootHelper::fgOutputFileFormat = "output%05d.root";
+std::string   TARootHelper::fgOutputPart;
 TApplication* TARootHelper::fgApp = NULL;
 TDirectory*   TARootHelper::fgDir = NULL;
 XmlServer*    TARootHelper::fgXmlServer = NULL;
@@ -178,7 +301,7 @@ TARootHelper::TARootHelper(const TARunInfo* runinfo) // ctor
 
    char xfilename[1024];
    // char* format = "${DH}/output%05d.root";
-   sprintf(xfilename, "output%05d.root", runinfo->fRunNo);
+   sprintf(xfilename, fgOutputFileFormat.c_str(), runinfo->fRunNo);
 
    fOutputFile = new TFile(xfilename, "RECREATE");
 
@@ -225,132 +348,1845 @@ TARegister::TARegister(TAFactory* m)
    gModules->push_back(m);
 }
 
-#if 0
 static double GetTimeSec()
 {
    struct timeval tv;
    gettimeofday(&tv,NULL);
    return tv.tv_sec + 0.000001*tv.tv_usec;
 }
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TATimeStats
+//
+//////////////////////////////////////////////////////////
+
+static unsigned gLogTiming = TALog::Category("timing");
+
+// histogram bucket: values below 4 ns have their own bucket,
+// above that 4 buckets per power of two
+
+static unsigned TimeBucket(uint64_t ns)
+{
+   if (ns < 4)
+      return ns;
+   unsigned e = 63 - __builtin_clzll(ns); // position of the top bit, >= 2
+   return 4*(e-1) + ((ns >> (e-2)) & 3);
+}
+
+static uint64_t TimeBucketUpperEdge(unsigned bucket)
+{
+   if (bucket < 4)
+      return bucket;
+   unsigned e = bucket/4 + 1;
+   uint64_t lower = (uint64_t)(4 + bucket%4) << (e-2);
+   return lower + ((uint64_t)1 << (e-2)) - 1;
+}
+
+TATimeStats::TATimeStats(const std::string& name) // ctor
+{
+   fName = name;
+   Reset();
+}
+
+uint64_t TATimeStats::Now()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void TATimeStats::Add(uint64_t ns)
+{
+   // the workers of TAWorkPool add to the same AnalyzeParallel statistics
+   std::memory_order r = std::memory_order_relaxed;
+   fCount.fetch_add(1, r);
+   fTotal.fetch_add(ns, r);
+   uint64_t min = fMin.load(r);
+   while (ns < min && !fMin.compare_exchange_weak(min, ns, r))
+      ;
+   uint64_t max = fMax.load(r);
+   while (ns > max && !fMax.compare_exchange_weak(max, ns, r))
+      ;
+   fBuckets[TimeBucket(ns)].fetch_add(1, r);
+}
+
+void TATimeStats::Reset()
+{
+   fCount = 0;
+   fTotal = 0;
+   fMin = UINT64_MAX;
+   fMax = 0;
+   for (unsigned i=0; i<TATIMESTATS_NBUCKETS; i++)
+      fBuckets[i] = 0;
+}
+
+uint64_t TATimeStats::GetPercentile(double p) const
+{
+   uint64_t count = GetCount();
+   if (count == 0)
+      return 0;
+   uint64_t want = (uint64_t)(p*count);
+   if (want < 1)
+      want = 1;
+   uint64_t sum = 0;
+   for (unsigned i=0; i<TATIMESTATS_NBUCKETS; i++) {
+      sum += fBuckets[i].load(std::memory_order_relaxed);
+      if (sum >= want) {
+         uint64_t v = TimeBucketUpperEdge(i);
+         uint64_t max = GetMax();
+         return (v < max) ? v : max;
+      }
+   }
+   return GetMax();
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TATiming
+//
+//////////////////////////////////////////////////////////
+
+static std::string ModuleName(const TARunObject* module)
+{
+   std::string name = typeid(*module).name();
+   int status = 0;
+   char* demangled = abi::__cxa_demangle(name.c_str(), NULL, NULL, &status);
+   if (demangled) {
+      name = demangled;
+      free(demangled);
+   }
+   return name;
+}
+
+bool   TATiming::fgEnabled = false;
+double TATiming::fgInterval = 0;
+
+TATiming::TATiming() // ctor
+   : fRead("read event"), fWrite("write event"), fEvent("whole event")
+{
+   fStartTime = 0;
+   fLastPrint = 0;
+}
+
+TATiming::~TATiming() // dtor
+{
+   Clear();
+}
+
+void TATiming::Clear()
+{
+   for (unsigned i=0; i<fBeginRun.size(); i++) {
+      delete fBeginRun[i];
+      delete fAnalyze[i];
+      delete fAnalyzeFlow[i];
+      delete fAnalyzeParallel[i];
+      delete fEndRun[i];
+   }
+   fBeginRun.clear();
+   fAnalyze.clear();
+   fAnalyzeFlow.clear();
+   fAnalyzeParallel.clear();
+   fEndRun.clear();
+}
+
+void TATiming::Setup(const std::vector<TARunObject*>& modules)
+{
+   Clear();
+
+   for (unsigned i=0; i<modules.size(); i++) {
+      std::string name = ModuleName(modules[i]);
+
+      fBeginRun.push_back(new TATimeStats(name + "::BeginRun"));
+      fAnalyze.push_back(new TATimeStats(name + "::Analyze"));
+      fAnalyzeFlow.push_back(new TATimeStats(name + "::AnalyzeFlowEvent"));
+      fAnalyzeParallel.push_back(new TATimeStats(name + "::AnalyzeParallel"));
+      fEndRun.push_back(new TATimeStats(name + "::EndRun"));
+   }
+
+   fRead.Reset();
+   fWrite.Reset();
+   fEvent.Reset();
+
+   fStartTime = GetTimeSec();
+   fLastPrint = fStartTime;
+}
+
+static void AppendTimeStats(std::string* s, const TATimeStats* t)
+{
+   uint64_t count = t->GetCount();
+   if (count == 0)
+      return;
+
+   double total = t->GetTotal()*1e-9;
+   char line[256];
+   snprintf(line, sizeof(line), "%-40s %10llu %10.3f %10.2f %10.2f %10.2f %10.2f %12.0f\n",
+            t->fName.c_str(),
+            (unsigned long long)count,
+            total,
+            1e-3*t->GetTotal()/count,
+            1e-3*t->GetMin(),
+            1e-3*t->GetMax(),
+            1e-3*t->GetPercentile(0.99),
+            (total > 0) ? count/total : 0.0);
+   s->append(line);
+}
+
+void TATiming::Print(const char* title) const
+{
+   std::string s;
+   char line[256];
+
+   snprintf(line, sizeof(line), "%-40s %10s %10s %10s %10s %10s %10s %12s\n", "stage", "calls", "total(s)", "mean(us)", "min(us)", "max(us)", "p99(us)", "calls/s");
+   s.append(line);
+
+   for (unsigned i=0; i<fBeginRun.size(); i++)
+      AppendTimeStats(&s, fBeginRun[i]);
+   for (unsigned i=0; i<fAnalyzeParallel.size(); i++)
+      AppendTimeStats(&s, fAnalyzeParallel[i]);
+   for (unsigned i=0; i<fAnalyze.size(); i++)
+      AppendTimeStats(&s, fAnalyze[i]);
+   for (unsigned i=0; i<fAnalyzeFlow.size(); i++)
+      AppendTimeStats(&s, fAnalyzeFlow[i]);
+   for (unsigned i=0; i<fEndRun.size(); i++)
+      AppendTimeStats(&s, fEndRun[i]);
+   AppendTimeStats(&s, &fRead);
+   AppendTimeStats(&s, &fWrite);
+   AppendTimeStats(&s, &fEvent);
+
+   double elapsed = GetTimeSec() - fStartTime;
+   uint64_t events = fEvent.GetCount();
+   snprintf(line, sizeof(line), "%llu events in %.1f sec, %.0f events/sec\n", (unsigned long long)events, elapsed, (elapsed > 0) ? events/elapsed : 0.0);
+   s.append(line);
+
+   TALOG(TALOG_INFO, gLogTiming, "Timing statistics, %s:\n%s", title, s.c_str());
+}
+
+void TATiming::PrintLive()
+{
+   double now = GetTimeSec();
+   if (now - fLastPrint < fgInterval)
+      return;
+   fLastPrint = now;
+   Print("run in progress");
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAMemory
+//
+//////////////////////////////////////////////////////////
+
+static unsigned gLogMemory = TALog::Category("memory");
+
+bool TAMemory::fgEnabled = false;
+int  TAMemory::fgInterval = 10000;
+int  TAMemory::fgWarnKB = 1024;
+
+TAMemory::TAMemory() // ctor
+{
+   fEvents = 0;
+   fLastEvents = 0;
+   fStartRss = 0;
+   fLastRss = 0;
+}
+
+int64_t TAMemory::HeapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+   struct mallinfo2 mi = mallinfo2();
+   return mi.uordblks + mi.hblkhd;
+#elif defined(__GLIBC__)
+   struct mallinfo mi = mallinfo(); // 32-bit counters, wrap around above 2 GB
+   return (unsigned)mi.uordblks + (unsigned)mi.hblkhd;
+#else
+   return 0;
 #endif
+}
 
-RunHandler::RunHandler(const std::vector<std::string>& args) { // ctor
-   fRunInfo = NULL;
-   fArgs = args;
+bool TAMemory::ReadRss(int64_t* rss_kb, int64_t* peak_kb)
+{
+   *rss_kb = 0;
+   *peak_kb = 0;
+
+   FILE* fp = fopen("/proc/self/statm","r");
+   if (!fp)
+      return false;
+
+   long size = 0;
+   long resident = 0;
+   int n = fscanf(fp,"%ld %ld",&size,&resident);
+   fclose(fp);
+
+   if (n != 2)
+      return false;
+
+   *rss_kb = resident*(sysconf(_SC_PAGESIZE)/1024);
+
+   fp = fopen("/proc/self/status","r");
+   if (fp) {
+      char line[256];
+      while (fgets(line, sizeof(line), fp)) {
+         if (strncmp(line, "VmHWM:", 6) == 0) {
+            *peak_kb = strtol(line+6, NULL, 10);
+            break;
+         }
+      }
+      fclose(fp);
+   }
+
+   return true;
 }
 
-RunHandler::~RunHandler() {//dtor
-   if (fRunInfo) {
-      delete fRunInfo;
-      fRunInfo = NULL;
+void TAMemory::Setup(const std::vector<TARunObject*>& modules)
+{
+   fNames.clear();
+   fAnalyzeHeap.clear();
+   for (unsigned i=0; i<modules.size(); i++) {
+      fNames.push_back(ModuleName(modules[i]));
+      fAnalyzeHeap.push_back(0);
    }
+
+   int64_t peak = 0;
+   ReadRss(&fStartRss, &peak);
+   fLastRss = fStartRss;
+   fEvents = 0;
+   fLastEvents = 0;
+
+   if (fgEnabled)
+      TALOG(TALOG_INFO, gLogMemory, "Memory at begin of run: RSS %lld kB, peak %lld kB\n", (long long)fStartRss, (long long)peak);
 }
 
-void RunHandler::CreateRun(int run_number, const char* file_name) {
-   assert(fRunInfo == NULL);
-   assert(fRunRun.size() == 0);
+void TAMemory::Event()
+{
+   fEvents++;
 
-   fRunInfo = new TARunInfo(run_number, file_name, fArgs);
+   if (fgInterval <= 0 || fEvents - fLastEvents < (uint64_t)fgInterval)
+      return;
 
-   for (unsigned i=0; i<(*gModules).size(); i++)
-      fRunRun.push_back((*gModules)[i]->NewRunObject(fRunInfo));
+   int64_t rss = 0;
+   int64_t peak = 0;
+   if (!ReadRss(&rss, &peak))
+      return;
+
+   double growth = (rss - fLastRss)*10000.0/(fEvents - fLastEvents); // kB per 10000 events
+
+   TALOG(TALOG_INFO, gLogMemory, "Memory after %llu events: RSS %lld kB, peak %lld kB, growth %.0f kB per 10000 events\n", (unsigned long long)fEvents, (long long)rss, (long long)peak, growth);
+
+   // the first interval includes filling histograms and buffers for the first time
+   if (fgWarnKB > 0 && fLastEvents > 0 && growth > fgWarnKB)
+      TALOG(TALOG_WARNING, gLogMemory, "WARNING: RSS grows by %.0f kB per 10000 events, more than %d kB, memory leak?\n", growth, fgWarnKB);
+
+   fLastRss = rss;
+   fLastEvents = fEvents;
 }
 
-void RunHandler::BeginRun()
+void TAMemory::Print(const char* title) const
 {
-   assert(fRunInfo != NULL);
-   assert(fRunInfo->fOdb != NULL);
-   for (unsigned i=0; i<fRunRun.size(); i++)
-      fRunRun[i]->BeginRun(fRunInfo);
+   std::string s;
+   char line[256];
+
+   int64_t rss = 0;
+   int64_t peak = 0;
+   ReadRss(&rss, &peak);
+
+   snprintf(line, sizeof(line), "RSS %lld kB at begin of run, %lld kB now, peak %lld kB, %llu events\n", (long long)fStartRss, (long long)rss, (long long)peak, (unsigned long long)fEvents);
+   s.append(line);
+
+   if (!gMultithread && gWorkers == 0) {
+      snprintf(line, sizeof(line), "%-40s %16s %20s\n", "module", "heap growth(kB)", "per 10k events(kB)");
+      s.append(line);
+      for (unsigned i=0; i<fNames.size(); i++) {
+         double kb = fAnalyzeHeap[i]/1024.0;
+         snprintf(line, sizeof(line), "%-40s %16.1f %20.1f\n", (fNames[i] + "::Analyze").c_str(), kb, fEvents ? kb*10000.0/fEvents : 0.0);
+         s.append(line);
+      }
+   }
+
+   TALOG(TALOG_INFO, gLogMemory, "Memory statistics, %s:\n%s", title, s.c_str());
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAArena
+//
+//////////////////////////////////////////////////////////
+
+thread_local TAArena* TAArena::fgCurrent = NULL;
+
+TAArena::TAArena(size_t block_size) // ctor
+{
+   fBlockSize = block_size;
+   fBlock = 0;
+   fPos = 0;
+}
+
+TAArena::~TAArena() // dtor
+{
+   for (unsigned i=0; i<fBlocks.size(); i++)
+      free(fBlocks[i].fData);
+   fBlocks.clear();
+}
+
+void* TAArena::Alloc(size_t size, size_t align)
+{
+   while (fBlock < fBlocks.size()) {
+      Block& b = fBlocks[fBlock];
+      size_t pos = (fPos + align - 1) & ~(align - 1);
+      if (pos + size <= b.fSize) {
+         fPos = pos + size;
+         return b.fData + pos;
+      }
+      // try the next block
+      fBlock++;
+      fPos = 0;
+   }
+
+   Block b;
+   b.fSize = fBlockSize;
+   if (b.fSize < size + align)
+      b.fSize = size + align;
+   b.fData = (char*)malloc(b.fSize);
+   assert(b.fData != NULL);
+   fBlocks.push_back(b);
+
+   fBlock = fBlocks.size() - 1;
+   size_t pos = (((uintptr_t)b.fData + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)b.fData;
+   fPos = pos + size;
+   return b.fData + pos;
+}
+
+void TAArena::Reset()
+{
+   fBlock = 0;
+   fPos = 0;
+}
+
+bool TAArena::Contains(const void* ptr) const
+{
+   const char* p = (const char*)ptr;
+   for (unsigned i=0; i<fBlocks.size(); i++)
+      if (p >= fBlocks[i].fData && p < fBlocks[i].fData + fBlocks[i].fSize)
+         return true;
+   return false;
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAEventPool
+//
+//////////////////////////////////////////////////////////
+
+TAEventPool::TAEventPool() // ctor
+{
+   fNumOut = 0;
+}
+
+TAEventPool::~TAEventPool() // dtor
+{
+   for (unsigned i=0; i<fFree.size(); i++)
+      delete fFree[i];
+   fFree.clear();
+}
+
+TMEvent* TAEventPool::NewEvent(const void* data, size_t size)
+{
+   TMEvent* event = NULL;
+
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      if (!fFree.empty()) {
+         event = fFree.back();
+         fFree.pop_back();
+      }
+      fNumOut++;
+   }
+
+   if (!event)
+      return new TMEvent(data, size);
+
+   // same as the TMEvent(data, size) constructor,
+   // but reuses the memory of the data and banks vectors
+
+   event->Reset();
+   event->ParseHeader(data, size);
+
+   if (event->error)
+      return event;
+
+   if (event->event_header_size + event->data_size > size) {
+      event->error = true;
+      return event;
+   }
+
+   const char* ptr = (const char*)data;
+   event->data.assign(ptr, ptr + event->event_header_size + event->data_size);
+   event->ParseEvent();
+
+   return event;
+}
+
+void TAEventPool::DeleteEvent(TMEvent* event)
+{
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      if (fNumOut > 0) {
+         fNumOut--;
+         fFree.push_back(event);
+         return;
+      }
+   }
+
+   // not from NewEvent(), nothing would reuse it
+   delete event;
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAEventReader
+//
+//////////////////////////////////////////////////////////
+
+TAEventReader::TAEventReader(const std::vector<std::string>& files, int depth, bool mmap) // ctor
+{
+   if (gTrace)
+      printf("TAEventReader::ctor, %d files, read-ahead depth %d, mmap %d\n", (int)files.size(), depth, mmap);
+
+   fFiles = files;
+   fDepth = depth;
+   if (fDepth < 0)
+      fDepth = 0;
+   fMmap = mmap;
+   if (fDepth > 0)
+      fMmap = false; // the read-ahead ring buffer holds TMEvent copies
+
+   fReader = NULL;
+   fMapped = NULL;
+   fIndex = NULL;
+   fIndexLoaded = false;
+   fFileIndex = 0;
+
+   fHead = 0;
+   fCount = 0;
+   fEof = false;
+   fStop = false;
+
+   if (fDepth > 0) {
+      fRing.resize(fDepth);
+      fThread = std::thread(&TAEventReader::Thread, this);
+   }
+}
+
+TAEventReader::~TAEventReader() // dtor
+{
+   if (gTrace)
+      printf("TAEventReader::dtor!\n");
+
+   if (fThread.joinable()) {
+      {
+         std::lock_guard<std::mutex> lock(fMutex);
+         fStop = true;
+         fCond.notify_all();
+      }
+      fThread.join();
+   }
+
+   while (fCount > 0) {
+      delete fRing[fHead].fEvent;
+      fHead = (fHead + 1) % fRing.size();
+      fCount--;
+   }
+
+   CloseFile();
+}
+
+void TAEventReader::CloseFile()
+{
+   if (fReader) {
+      fReader->Close();
+      delete fReader;
+      fReader = NULL;
+   }
+
+   if (fMapped) {
+      delete fMapped;
+      fMapped = NULL;
+   }
+
+   if (fIndex) {
+      delete fIndex;
+      fIndex = NULL;
+   }
+}
+
+bool TAEventReader::ReadNext(int* file_index, TMEvent** event, TMEventView* view)
+{
+   *event = NULL;
+
+   while (fFileIndex < (int)fFiles.size()) {
+      const std::string& filename = fFiles[fFileIndex];
+
+      if (!fReader && !fMapped) {
+         if (fMmap && TMMappedFile::CanMap(filename.c_str())) {
+            fMapped = new TMMappedFile(filename.c_str());
+
+            if (fMapped->fError) {
+               printf("Could not map \"%s\", error: %s\n", filename.c_str(), fMapped->fErrorString.c_str());
+               delete fMapped;
+               fMapped = NULL;
+               fFileIndex++;
+               continue;
+            }
+
+            fIndex = new TMEventIndex(filename.c_str());
+            fIndexLoaded = fIndex->Load();
+         } else {
+            fReader = TMNewReader(filename.c_str());
+
+            if (fReader->fError) {
+               printf("Could not open \"%s\", error: %s\n", filename.c_str(), fReader->fErrorString.c_str());
+               delete fReader;
+               fReader = NULL;
+               fFileIndex++;
+               continue;
+            }
+         }
+      }
+
+      if (fMapped) {
+         if (fMapped->ReadEvent(view)) {
+            if (!fIndexLoaded)
+               fIndex->Add(view);
+            *file_index = fFileIndex;
+            if (view->event_id & 0x8000) // special events are returned as TMEvent
+               *event = view->NewEvent();
+            return true;
+         }
+
+         if (!fIndexLoaded && fMapped->fPos == fMapped->fSize) {
+            if (fIndex->Save())
+               printf("Wrote event index \"%s\", %d events\n", TMEventIndex::IndexFilename(filename.c_str()).c_str(), (int)fIndex->fEntries.size());
+         }
+      } else {
+         TMEvent* e = TMReadEvent(fReader);
+
+         if (e && !e->error) {
+            *file_index = fFileIndex;
+            *event = e;
+            return true;
+         }
+
+         if (e)
+            delete e;
+      }
+
+      // EOF or error, go to the next file
+
+      CloseFile();
+      fFileIndex++;
+   }
+
+   return false;
+}
+
+void TAEventReader::Thread()
+{
+   if (gTrace)
+      printf("TAEventReader::Thread: started\n");
+
+   while (1) {
+      int file_index = 0;
+      TMEvent* event = NULL;
+      TMEventView view;
+      bool ok = ReadNext(&file_index, &event, &view);
+
+      std::unique_lock<std::mutex> lock(fMutex);
+
+      if (!ok) {
+         fEof = true;
+         fCond.notify_all();
+         break;
+      }
+
+      assert(event != NULL); // no mapped files in read-ahead mode
+
+      while (fCount == fRing.size() && !fStop)
+         fCond.wait(lock);
+
+      if (fStop) {
+         delete event;
+         break;
+      }
+
+      unsigned tail = (fHead + fCount) % fRing.size();
+      fRing[tail].fEvent = event;
+      fRing[tail].fFileIndex = file_index;
+      fCount++;
+      fCond.notify_all();
+   }
+
+   if (gTrace)
+      printf("TAEventReader::Thread: stopped\n");
+}
+
+int TAEventReader::SkipDataEvents(int num_skip)
+{
+   if (!fMapped || !fIndexLoaded || num_skip <= 0)
+      return 0;
+
+   int skipped = 0;
+   fMapped->Seek(fIndex->Skip(fMapped->fPos, num_skip, &skipped));
+   return skipped;
+}
+
+int TAEventReader::SkipToSerial(uint32_t serial_number)
+{
+   if (!fMapped || !fIndexLoaded)
+      return 0;
+
+   int skipped = 0;
+   fMapped->Seek(fIndex->SkipToSerial(fMapped->fPos, serial_number, &skipped));
+   return skipped;
+}
+
+bool TAEventReader::Read(int* file_index, TMEvent** event, TMEventView* view)
+{
+   if (fDepth == 0)
+      return ReadNext(file_index, event, view);
+
+   std::unique_lock<std::mutex> lock(fMutex);
+
+   while (fCount == 0 && !fEof)
+      fCond.wait(lock);
+
+   if (fCount == 0)
+      return false;
+
+   *event = fRing[fHead].fEvent;
+   *file_index = fRing[fHead].fFileIndex;
+   fRing[fHead].fEvent = NULL;
+   fHead = (fHead + 1) % fRing.size();
+   fCount--;
+   fCond.notify_all();
+
+   return true;
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAAsyncWriter
+//
+//////////////////////////////////////////////////////////
+
+static std::mutex gAsyncWritersMutex;
+static std::vector<TAAsyncWriter*> gAsyncWriters;
+
+TAAsyncWriter::TAAsyncWriter(TMWriterInterface* writer, size_t max_bytes) // ctor
+{
+   if (gTrace)
+      printf("TAAsyncWriter::ctor, max_bytes %zu\n", max_bytes);
+
+   fWriter = writer;
+   fMaxBytes = max_bytes;
+   fChunkBytes = std::min(max_bytes/2, (size_t)1024*1024);
+   if (fChunkBytes < 1)
+      fChunkBytes = 1;
+   fWriting = 0;
+   fFlush = false;
+   fStop = false;
+   fError = false;
+   fTotalBytes = 0;
+   fWaits = 0;
+
+   fThread = std::thread(&TAAsyncWriter::Thread, this);
+
+   std::lock_guard<std::mutex> lock(gAsyncWritersMutex);
+   gAsyncWriters.push_back(this);
+}
+
+TAAsyncWriter::~TAAsyncWriter() // dtor
+{
+   if (gTrace)
+      printf("TAAsyncWriter::dtor!\n");
+
+   {
+      std::lock_guard<std::mutex> lock(gAsyncWritersMutex);
+      gAsyncWriters.erase(std::remove(gAsyncWriters.begin(), gAsyncWriters.end(), this), gAsyncWriters.end());
+   }
+
+   Close();
+
+   delete fWriter;
+   fWriter = NULL;
+}
+
+int TAAsyncWriter::Write(const void* buf, int count)
+{
+   std::unique_lock<std::mutex> lock(fMutex);
+
+   if (fStop) {
+      fprintf(stderr, "TAAsyncWriter::Write: writer is closed\n");
+      return -1;
+   }
+
+   // the writer thread could not write earlier data, the output is incomplete
+   if (fError)
+      return -1;
+
+   // backpressure: wait for the writer thread, but always accept data if nothing is queued
+   bool waited = false;
+   while (fBuffer.size() + fWriting > 0 && fBuffer.size() + fWriting + count > fMaxBytes) {
+      waited = true;
+      fFlush = true;
+      fCond.notify_one();
+      fWritten.wait(lock);
+   }
+
+   if (waited)
+      fWaits++;
+
+   fBuffer.append((const char*)buf, count);
+   fTotalBytes += count;
+
+   if (fBuffer.size() >= fChunkBytes)
+      fCond.notify_one();
+
+   return count;
+}
+
+void TAAsyncWriter::Flush()
+{
+   std::unique_lock<std::mutex> lock(fMutex);
+   fFlush = true;
+   fCond.notify_one();
+   while (!fBuffer.empty() || fWriting > 0)
+      fWritten.wait(lock);
+}
+
+int TAAsyncWriter::Close()
+{
+   if (!fThread.joinable())
+      return fError ? -1 : 0;
+
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+      fCond.notify_one();
+   }
+
+   fThread.join();
+
+   if (fWaits > 0)
+      printf("TAAsyncWriter: wrote %.1f Mbytes, the analysis waited %d times for the output, consider a larger --writebuffer\n", fTotalBytes/(1024.0*1024.0), fWaits);
+
+   int status = fWriter->Close();
+   if (fError)
+      return -1;
+   return status;
+}
+
+void TAAsyncWriter::FlushAll()
+{
+   std::lock_guard<std::mutex> lock(gAsyncWritersMutex);
+   for (unsigned i=0; i<gAsyncWriters.size(); i++)
+      gAsyncWriters[i]->Flush();
+}
+
+void TAAsyncWriter::Thread()
+{
+   std::string buf;
+   std::unique_lock<std::mutex> lock(fMutex);
+   while (1) {
+      while (!fStop && !fFlush && fBuffer.size() < fChunkBytes)
+         fCond.wait(lock);
+
+      if (fBuffer.empty()) {
+         fFlush = false;
+         fWritten.notify_all();
+         if (fStop)
+            break;
+         continue;
+      }
+
+      buf.swap(fBuffer);
+      fWriting = buf.size();
+      lock.unlock();
+
+      // TMWriterInterface::Write() takes an int count
+      bool error = fError;
+      size_t pos = 0;
+      while (pos < buf.size()) {
+         int count = (int)std::min(buf.size() - pos, (size_t)1024*1024*1024);
+         int wr = fWriter->Write(buf.data() + pos, count);
+         if (wr != count && !error) {
+            fprintf(stderr, "TAAsyncWriter: write error, wrote %d instead of %d bytes, output file is incomplete\n", wr, count);
+            error = true;
+         }
+         pos += count;
+      }
+      buf.clear();
+
+      lock.lock();
+      fError = error; // read by Write() and Close() under the lock
+      fWriting = 0;
+      fWritten.notify_all();
+   }
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAPipeline
+//
+//////////////////////////////////////////////////////////
+
+TAPipeline::TAPipeline(TARunInfo* runinfo, const std::vector<TARunObject*>& modules, int max_backlog, TAEventPool* pool, TATiming* timing) // ctor
+{
+   if (gTrace)
+      printf("TAPipeline::ctor, %d modules, max backlog %d\n", (int)modules.size(), max_backlog);
+
+   assert(modules.size() > 0);
+
+   fRunInfo = runinfo;
+   fModules = modules;
+   fMaxBacklog = max_backlog;
+   if (fMaxBacklog < 1)
+      fMaxBacklog = 1;
+   fQuit = false;
+   fShutdown = false;
+   fBacklog = 0;
+   fEventPool = pool;
+   fTiming = timing;
+
+   for (unsigned i=0; i<fModules.size(); i++)
+      fStages.push_back(new TAPipelineStage);
+
+   for (unsigned i=0; i<fModules.size(); i++)
+      fThreads.push_back(std::thread(&TAPipeline::Thread, this, i));
+}
+
+TAPipeline::~TAPipeline() // dtor
+{
+   if (gTrace)
+      printf("TAPipeline::dtor!\n");
+
+   Drain();
+
+   fShutdown = true;
+
+   for (unsigned i=0; i<fStages.size(); i++) {
+      std::lock_guard<std::mutex> lock(fStages[i]->fMutex);
+      fStages[i]->fCond.notify_all();
+   }
+
+   for (unsigned i=0; i<fThreads.size(); i++)
+      fThreads[i].join();
+
+   for (unsigned i=0; i<fStages.size(); i++) {
+      assert(fStages[i]->fQueue.empty());
+      delete fStages[i];
+      fStages[i] = NULL;
+   }
+
+   for (unsigned i=0; i<fFreeItems.size(); i++)
+      delete fFreeItems[i];
+   fFreeItems.clear();
+}
+
+void TAPipeline::Submit(TMEvent* event, TMWriterInterface* writer)
+{
+   TAPipelineItem* item = NULL;
+
+   {
+      std::unique_lock<std::mutex> lock(fBacklogMutex);
+      while (fBacklog >= fMaxBacklog)
+         fBacklogCond.wait(lock);
+      fBacklog++;
+      if (!fFreeItems.empty()) {
+         item = fFreeItems.back();
+         fFreeItems.pop_back();
+      }
+   }
+
+   if (!item)
+      item = new TAPipelineItem;
+
+   item->fEvent = event;
+   item->fFlow = NULL;
+   item->fFlags = 0;
+   item->fStartTime = TATiming::Start();
+   item->fFlowPhase = false;
+   item->fRunFlow = false;
+   item->fWriter = writer;
+
+   Push(0, item);
+}
+
+void TAPipeline::Drain()
+{
+   std::unique_lock<std::mutex> lock(fBacklogMutex);
+   while (fBacklog > 0)
+      fBacklogCond.wait(lock);
+}
+
+void TAPipeline::Push(unsigned stage, TAPipelineItem* item)
+{
+   TAPipelineStage* s = fStages[stage];
+   std::lock_guard<std::mutex> lock(s->fMutex);
+   s->fQueue.push_back(item);
+   s->fCond.notify_one();
+}
+
+TAPipelineItem* TAPipeline::Pop(unsigned stage)
+{
+   TAPipelineStage* s = fStages[stage];
+   std::unique_lock<std::mutex> lock(s->fMutex);
+   while (s->fQueue.empty()) {
+      if (fShutdown)
+         return NULL;
+      s->fCond.wait(lock);
+   }
+   TAPipelineItem* item = s->fQueue.front();
+   s->fQueue.pop_front();
+   return item;
+}
+
+void TAPipeline::Done(TAPipelineItem* item)
+{
+   if (item->fFlags & TAFlag_QUIT)
+      fQuit = true;
+
+   if (item->fFlags & TAFlag_WRITE)
+      if (item->fWriter) {
+         uint64_t t0 = TATiming::Start();
+         TMWriteEvent(item->fWriter, item->fEvent);
+         fTiming->fWrite.Stop(t0);
+      }
+
+   TAArena::SetCurrent(&item->fArena);
+   if (item->fFlow)
+      delete item->fFlow;
+   TAArena::SetCurrent(NULL);
+   item->fFlow = NULL;
+   item->fArena.Reset();
+
+   if (item->fEvent)
+      fEventPool->DeleteEvent(item->fEvent);
+   item->fEvent = NULL;
+
+   fTiming->fEvent.Stop(item->fStartTime);
+
+   std::lock_guard<std::mutex> lock(fBacklogMutex);
+   fFreeItems.push_back(item);
+   fBacklog--;
+   fBacklogCond.notify_all();
+}
+
+void TAPipeline::Thread(unsigned stage)
+{
+   if (gTrace)
+      printf("TAPipeline::Thread: stage %d started\n", stage);
+
+   TARunObject* module = fModules[stage];
+   bool last = (stage == fModules.size() - 1);
+
+   while (1) {
+      TAPipelineItem* item = Pop(stage);
+      if (!item)
+         break;
+
+      // NB: the item travels through the stages in the same order
+      // as the serial loops in RunHandler::AnalyzeEvent()
+
+      TAArena::SetCurrent(&item->fArena);
+
+      if (!item->fFlowPhase) {
+         if (module->fParallel && !(item->fFlags & TAFlag_SKIP)) {
+            uint64_t t0 = TATiming::Start();
+            item->fFlow = module->AnalyzeParallel(fRunInfo, item->fEvent, &item->fFlags, item->fFlow);
+            fTiming->fAnalyzeParallel[stage]->Stop(t0);
+         }
+         if (!(item->fFlags & TAFlag_SKIP)) {
+            uint64_t t0 = TATiming::Start();
+            item->fFlow = module->Analyze(fRunInfo, item->fEvent, &item->fFlags, item->fFlow);
+            fTiming->fAnalyze[stage]->Stop(t0);
+         }
+         if (last) {
+            item->fFlowPhase = true;
+            item->fRunFlow = item->fFlow && !(item->fFlags & TAFlag_SKIP);
+            Push(0, item);
+         } else {
+            Push(stage+1, item);
+         }
+      } else {
+         if (item->fRunFlow && !(item->fFlags & TAFlag_SKIP)) {
+            uint64_t t0 = TATiming::Start();
+            item->fFlow = module->AnalyzeFlowEvent(fRunInfo, &item->fFlags, item->fFlow);
+            fTiming->fAnalyzeFlow[stage]->Stop(t0);
+         }
+         if (last)
+            Done(item);
+         else
+            Push(stage+1, item);
+      }
+
+      TAArena::SetCurrent(NULL);
+   }
+
+   if (gTrace)
+      printf("TAPipeline::Thread: stage %d stopped\n", stage);
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of TAWorkPool
+//
+//////////////////////////////////////////////////////////
+
+TAWorkPool::TAWorkPool(TARunInfo* runinfo, const std::vector<TARunObject*>& modules, int nthreads, TATiming* timing) // ctor
+{
+   if (gTrace)
+      printf("TAWorkPool::ctor, %d threads\n", nthreads);
+
+   assert(nthreads > 0);
+
+   fRunInfo = runinfo;
+   for (unsigned i=0; i<modules.size(); i++) {
+      if (modules[i]->fParallel) {
+         fModules.push_back(modules[i]);
+         fModuleIndex.push_back(i);
+      }
+   }
+   fTiming = timing;
+   fNextQueue = 0;
+   fNumQueued = 0;
+   fShutdown = false;
+
+   for (int i=0; i<nthreads; i++)
+      fQueues.push_back(new Queue);
+
+   for (int i=0; i<nthreads; i++)
+      fThreads.push_back(std::thread(&TAWorkPool::Thread, this, i));
+}
+
+TAWorkPool::~TAWorkPool() // dtor
+{
+   if (gTrace)
+      printf("TAWorkPool::dtor!\n");
+
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fShutdown = true;
+      fWorkCond.notify_all();
+   }
+
+   for (unsigned i=0; i<fThreads.size(); i++)
+      fThreads[i].join();
+
+   for (unsigned i=0; i<fQueues.size(); i++) {
+      assert(fQueues[i]->fItems.empty());
+      delete fQueues[i];
+      fQueues[i] = NULL;
+   }
+}
+
+void TAWorkPool::Submit(const std::vector<TAWorkItem*>& batch)
+{
+   if (batch.empty())
+      return;
+
+   Queue* q = fQueues[fNextQueue];
+   fNextQueue = (fNextQueue + 1) % fQueues.size();
+
+   {
+      std::lock_guard<std::mutex> lock(q->fMutex);
+      for (unsigned i=0; i<batch.size(); i++)
+         q->fItems.push_back(batch[i]);
+   }
+
+   std::lock_guard<std::mutex> lock(fMutex);
+   fNumQueued += batch.size();
+   fWorkCond.notify_all();
+}
+
+void TAWorkPool::Wait(TAWorkItem* item)
+{
+   std::unique_lock<std::mutex> lock(fMutex);
+   while (!item->fDone)
+      fDoneCond.wait(lock);
+}
+
+TAWorkItem* TAWorkPool::Pop(unsigned index)
+{
+   {
+      std::unique_lock<std::mutex> lock(fMutex);
+      while (fNumQueued == 0) {
+         if (fShutdown)
+            return NULL;
+         fWorkCond.wait(lock);
+      }
+      fNumQueued--; // one of the queued items is ours
+   }
+
+   // NB: items are added to a queue before fNumQueued is incremented,
+   // so the item reserved above is in one of the queues
+
+   while (1) {
+      // oldest item of the own queue
+      {
+         Queue* q = fQueues[index];
+         std::lock_guard<std::mutex> lock(q->fMutex);
+         if (!q->fItems.empty()) {
+            TAWorkItem* item = q->fItems.front();
+            q->fItems.pop_front();
+            return item;
+         }
+      }
+
+      // steal the newest item of another queue
+      for (unsigned i=1; i<fQueues.size(); i++) {
+         Queue* q = fQueues[(index + i) % fQueues.size()];
+         std::lock_guard<std::mutex> lock(q->fMutex);
+         if (!q->fItems.empty()) {
+            TAWorkItem* item = q->fItems.back();
+            q->fItems.pop_back();
+            return item;
+         }
+      }
+   }
+}
+
+void TAWorkPool::Run(TAWorkItem* item)
+{
+   TAArena::SetCurrent(&item->fArena);
+
+   for (unsigned i=0; i<fModules.size(); i++) {
+      if (item->fFlags & TAFlag_SKIP)
+         break;
+      uint64_t t0 = TATiming::Start();
+      item->fFlow = fModules[i]->AnalyzeParallel(fRunInfo, item->fEvent, &item->fFlags, item->fFlow);
+      fTiming->fAnalyzeParallel[fModuleIndex[i]]->Stop(t0);
+   }
+
+   TAArena::SetCurrent(NULL);
+}
+
+void TAWorkPool::Thread(unsigned index)
+{
+   if (gTrace)
+      printf("TAWorkPool::Thread: worker %d started\n", index);
+
+   while (1) {
+      TAWorkItem* item = Pop(index);
+      if (!item)
+         break;
+
+      Run(item);
+
+      std::lock_guard<std::mutex> lock(fMutex);
+      item->fDone = true;
+      fDoneCond.notify_all();
+   }
+
+   if (gTrace)
+      printf("TAWorkPool::Thread: worker %d stopped\n", index);
+}
+
+//////////////////////////////////////////////////////////
+//
+// Methods of RunHandler
+//
+//////////////////////////////////////////////////////////
+
+RunHandler::RunHandler(const std::vector<std::string>& args) { // ctor
+   fRunInfo = NULL;
+   fArgs = args;
+   fPipeline = NULL;
+   fWorkPool = NULL;
+   fWorkQuit = false;
+   fLastRefresh = 0;
+}
+
+RunHandler::~RunHandler() {//dtor
+   if (fPipeline) {
+      delete fPipeline;
+      fPipeline = NULL;
+   }
+   if (fWorkPool) {
+      DrainWork();
+      delete fWorkPool;
+      fWorkPool = NULL;
+   }
+   for (unsigned i=0; i<fWorkFree.size(); i++)
+      delete fWorkFree[i];
+   fWorkFree.clear();
+   if (fRunInfo) {
+      delete fRunInfo;
+      fRunInfo = NULL;
+   }
+}
+
+void RunHandler::CreateRun(int run_number, const char* file_name) {
+   assert(fRunInfo == NULL);
+   assert(fRunRun.size() == 0);
+
+   fRunInfo = new TARunInfo(run_number, file_name, fArgs);
+
+   for (unsigned i=0; i<(*gModules).size(); i++)
+      fRunRun.push_back((*gModules)[i]->NewRunObject(fRunInfo));
+}
+
+void RunHandler::BeginRun()
+{
+   assert(fRunInfo != NULL);
+   assert(fRunInfo->fOdb != NULL);
+
+   fTiming.Setup(fRunRun);
+   fMemory.Setup(fRunRun);
+
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      uint64_t t0 = TATiming::Start();
+      fRunRun[i]->BeginRun(fRunInfo);
+      fTiming.fBeginRun[i]->Stop(t0);
+   }
+
+   assert(fPipeline == NULL);
+   if (gMultithread && fRunRun.size() > 0)
+      fPipeline = new TAPipeline(fRunInfo, fRunRun, gMtMaxBacklog, &fEventPool, &fTiming);
+
+   assert(fWorkPool == NULL);
+   fWorkQuit = false;
+   if (gWorkers > 0) {
+      bool parallel = false;
+      for (unsigned i=0; i<fRunRun.size(); i++)
+         if (fRunRun[i]->fParallel)
+            parallel = true;
+      if (parallel)
+         fWorkPool = new TAWorkPool(fRunInfo, fRunRun, gWorkers, &fTiming);
+      else
+         fprintf(stderr, "RunHandler::BeginRun: no module has a parallel part, --workers%d is not used\n", gWorkers);
+   }
+}
+
+void RunHandler::EndRun()
+{
+   assert(fRunInfo);
+
+   if (fPipeline) {
+      delete fPipeline; // finish all queued events
+      fPipeline = NULL;
+   }
+
+   if (fWorkPool) {
+      DrainWork(); // finish all queued events
+      delete fWorkPool;
+      fWorkPool = NULL;
+   }
+
+   // do not keep the arenas of the items between runs, QueueEvent() makes new ones
+   for (unsigned i=0; i<fWorkFree.size(); i++)
+      delete fWorkFree[i];
+   fWorkFree.clear();
+
+   TAAsyncWriter::FlushAll(); // events of this run are on disk
+
+   std::deque<TAFlowEvent*> flow_queue;
+
+   for (unsigned i=0; i<fRunRun.size(); i++)
+      fRunRun[i]->PreEndRun(fRunInfo, &flow_queue);
+
+   while (!flow_queue.empty()) {
+      TAFlowEvent* flow = flow_queue.front();
+      flow_queue.pop_front();
+
+      int flags = 0;
+
+      for (unsigned i=0; i<fRunRun.size(); i++) {
+         flow = fRunRun[i]->AnalyzeFlowEvent(fRunInfo, &flags, flow);
+         if (flags & TAFlag_SKIP)
+            break;
+      }
+
+      delete flow;
+   }
+
+   // after the flow events of PreEndRun(), they fill histograms too
+#ifdef HAVE_ROOT
+   TAHistogram::FlushAll(); // histograms are complete before EndRun()
+#endif
+
+   RefreshDisplay(true); // show the final histograms
+
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      uint64_t t0 = TATiming::Start();
+      fRunRun[i]->EndRun(fRunInfo);
+      fTiming.fEndRun[i]->Stop(t0);
+   }
+
+   char title[256];
+   snprintf(title, sizeof(title), "run %d", fRunInfo->fRunNo);
+
+   if (TATiming::fgEnabled)
+      fTiming.Print(title);
+
+   if (TAMemory::fgEnabled)
+      fMemory.Print(title);
+}
+
+void RunHandler::NextSubrun()
+{
+   assert(fRunInfo);
+
+   if (fPipeline)
+      fPipeline->Drain();
+
+   DrainWork();
+
+   TAAsyncWriter::FlushAll();
+
+   for (unsigned i=0; i<fRunRun.size(); i++)
+      fRunRun[i]->NextSubrun(fRunInfo);
+}
+
+void RunHandler::DeleteRun()
+{
+   assert(fRunInfo);
+
+   if (fPipeline) {
+      delete fPipeline;
+      fPipeline = NULL;
+   }
+
+   if (fWorkPool) {
+      DrainWork();
+      delete fWorkPool;
+      fWorkPool = NULL;
+   }
+
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      delete fRunRun[i];
+      fRunRun[i] = NULL;
+   }
+
+   fRunRun.clear();
+   assert(fRunRun.size() == 0);
+
+   delete fRunInfo;
+   fRunInfo = NULL;
+}
+
+void RunHandler::AnalyzeSpecialEvent(TMEvent* event)
+{
+   if (fPipeline)
+      fPipeline->Drain(); // keep special events in order with the data events
+
+   DrainWork();
+
+   for (unsigned i=0; i<fRunRun.size(); i++)
+      fRunRun[i]->AnalyzeSpecialEvent(fRunInfo, event);
+}
+
+void RunHandler::AnalyzeEvent(TMEvent* event, TAFlags* flags, TMWriterInterface *writer)
+{
+   assert(fRunInfo != NULL);
+   assert(fRunInfo->fOdb != NULL);
+
+   TAArena::SetCurrent(&fArena);
+
+   uint64_t start = TATiming::Start();
+   TAFlowEvent* flow = NULL;
+
+   // without the worker pool, the parallel part runs here
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      if (!fRunRun[i]->fParallel)
+         continue;
+      uint64_t t0 = TATiming::Start();
+      flow = fRunRun[i]->AnalyzeParallel(fRunInfo, event, flags, flow);
+      fTiming.fAnalyzeParallel[i]->Stop(t0);
+      if (*flags & TAFlag_SKIP)
+         break;
+   }
+
+   AnalyzeModules(event, flags, writer, flow);
+
+   TAArena::SetCurrent(NULL);
+   fArena.Reset();
+
+   fTiming.fEvent.Stop(start);
+   if (TATiming::fgInterval > 0)
+      fTiming.PrintLive();
+   if (TAMemory::fgEnabled)
+      fMemory.Event();
+}
+
+void RunHandler::AnalyzeModules(TMEvent* event, TAFlags* flags, TMWriterInterface *writer, TAFlowEvent* flow)
+{
+   if (!(*flags & TAFlag_SKIP)) {
+      for (unsigned i=0; i<fRunRun.size(); i++) {
+         uint64_t t0 = TATiming::Start();
+         int64_t m0 = TAMemory::Start();
+         flow = fRunRun[i]->Analyze(fRunInfo, event, flags, flow);
+         fMemory.Stop(i, m0);
+         fTiming.fAnalyze[i]->Stop(t0);
+         if (*flags & TAFlag_SKIP)
+            break;
+      }
+   }
+
+   AnalyzeFlow(event, flags, writer, flow);
+}
+
+void RunHandler::AnalyzeFlow(TMEvent* event, TAFlags* flags, TMWriterInterface *writer, TAFlowEvent* flow)
+{
+   if (flow && !(*flags & TAFlag_SKIP)) {
+      for (unsigned i=0; i<fRunRun.size(); i++) {
+         uint64_t t0 = TATiming::Start();
+         flow = fRunRun[i]->AnalyzeFlowEvent(fRunInfo, flags, flow);
+         fTiming.fAnalyzeFlow[i]->Stop(t0);
+         if (*flags & TAFlag_SKIP)
+            break;
+      }
+   }
+
+   if (*flags & TAFlag_WRITE)
+      if (writer) {
+         uint64_t t0 = TATiming::Start();
+         TMWriteEvent(writer, event);
+         fTiming.fWrite.Stop(t0);
+      }
+
+   if (flow)
+      delete flow;
 }
 
-void RunHandler::EndRun()
+// number of events up to and including the first one with TAFlag_QUIT
+
+static int FirstQuit(const TAFlags* flags, int n)
 {
-   assert(fRunInfo);
+   for (int k=0; k<n; k++)
+      if (flags[k] & TAFlag_QUIT)
+         return k + 1;
+   return n;
+}
 
-   std::deque<TAFlowEvent*> flow_queue;
+// Analyze() of all modules for the whole block, module by module: modules
+// with fBatch set get the events not skipped by the previous modules in
+// one AnalyzeBatch() call, the others get one Analyze() call per event.
+// Then AnalyzeFlowEvent() and writing, event by event in order. The flow
+// events of the whole block stay in the arena until the end of the block.
+// As event by event, nothing after the first event with TAFlag_QUIT is
+// analyzed any further or written.
 
-   for (unsigned i=0; i<fRunRun.size(); i++)
-      fRunRun[i]->PreEndRun(fRunInfo, &flow_queue);
+void RunHandler::AnalyzeBatch(TMEvent** events, int n, TAFlags* flags, TMWriterInterface *writer)
+{
+   assert(fRunInfo != NULL);
+   assert(fRunInfo->fOdb != NULL);
+   assert(fPipeline == NULL);
+   assert(fWorkPool == NULL);
 
-   while (!flow_queue.empty()) {
-      TAFlowEvent* flow = flow_queue.front();
-      flow_queue.pop_front();
+   TAArena::SetCurrent(&fArena);
 
-      int flags = 0;
+   uint64_t start = TATiming::Start();
 
+   fBatchFlows.assign(n, NULL);
+
+   for (int k=0; k<n; k++) {
+      flags[k] = 0;
       for (unsigned i=0; i<fRunRun.size(); i++) {
-         flow = fRunRun[i]->AnalyzeFlowEvent(fRunInfo, &flags, flow);
-         if (flags & TAFlag_SKIP)
+         if (!fRunRun[i]->fParallel)
+            continue;
+         uint64_t t0 = TATiming::Start();
+         fBatchFlows[k] = fRunRun[i]->AnalyzeParallel(fRunInfo, events[k], &flags[k], fBatchFlows[k]);
+         fTiming.fAnalyzeParallel[i]->Stop(t0);
+         if (flags[k] & TAFlag_SKIP)
             break;
       }
+   }
 
-      delete flow;
+   int nq = FirstQuit(flags, n); // events up to the first one with TAFlag_QUIT
+
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      TARunObject* m = fRunRun[i];
+
+      if (!m->fBatch) {
+         for (int k=0; k<nq; k++) {
+            if (flags[k] & TAFlag_SKIP)
+               continue;
+            uint64_t t0 = TATiming::Start();
+            int64_t m0 = TAMemory::Start();
+            fBatchFlows[k] = m->Analyze(fRunInfo, events[k], &flags[k], fBatchFlows[k]);
+            fMemory.Stop(i, m0);
+            fTiming.fAnalyze[i]->Stop(t0);
+            if (flags[k] & TAFlag_QUIT)
+               nq = k + 1;
+         }
+         continue;
+      }
+
+      fBatchModuleEvents.clear();
+      fBatchModuleFlags.clear();
+      fBatchModuleFlows.clear();
+      fBatchModuleIndex.clear();
+
+      for (int k=0; k<nq; k++) {
+         if (flags[k] & TAFlag_SKIP)
+            continue;
+         fBatchModuleEvents.push_back(events[k]);
+         fBatchModuleFlags.push_back(flags[k]);
+         fBatchModuleFlows.push_back(fBatchFlows[k]);
+         fBatchModuleIndex.push_back(k);
+      }
+
+      int nm = fBatchModuleEvents.size();
+      if (nm == 0)
+         continue;
+
+      uint64_t t0 = TATiming::Start();
+      int64_t m0 = TAMemory::Start();
+      m->AnalyzeBatch(fRunInfo, fBatchModuleEvents.data(), nm, fBatchModuleFlags.data(), fBatchModuleFlows.data());
+      fMemory.Stop(i, m0);
+      fTiming.fAnalyze[i]->Stop(t0); // one call per block
+
+      for (int j=0; j<nm; j++) {
+         int k = fBatchModuleIndex[j];
+         flags[k] = fBatchModuleFlags[j];
+         fBatchFlows[k] = fBatchModuleFlows[j];
+      }
+
+      nq = FirstQuit(flags, nq);
    }
 
-   for (unsigned i=0; i<fRunRun.size(); i++)
-      fRunRun[i]->EndRun(fRunInfo);
-}
+   for (int k=0; k<n; k++) {
+      if (k < nq)
+         AnalyzeFlow(events[k], &flags[k], writer, fBatchFlows[k]);
+      else if (fBatchFlows[k]) // after the quit, not written
+         delete fBatchFlows[k];
+      fBatchFlows[k] = NULL;
+      fEventPool.DeleteEvent(events[k]);
+      events[k] = NULL;
+   }
 
-void RunHandler::NextSubrun()
-{
-   assert(fRunInfo);
+   TAArena::SetCurrent(NULL);
+   fArena.Reset();
 
-   for (unsigned i=0; i<fRunRun.size(); i++)
-      fRunRun[i]->NextSubrun(fRunInfo);
+   if (start) {
+      uint64_t per_event = (TATimeStats::Now() - start)/n;
+      for (int k=0; k<n; k++)
+         fTiming.fEvent.Add(per_event);
+   }
+   if (TATiming::fgInterval > 0)
+      fTiming.PrintLive();
+   if (TAMemory::fgEnabled)
+      for (int k=0; k<n; k++)
+         fMemory.Event();
+
+   RefreshDisplay();
 }
 
-void RunHandler::DeleteRun()
+void RunHandler::FinishWork()
 {
-   assert(fRunInfo);
+   TAWorkItem* item = fWorkQueue.front();
 
-   for (unsigned i=0; i<fRunRun.size(); i++) {
-      delete fRunRun[i];
-      fRunRun[i] = NULL;
+   // the oldest event may still be in the batch being collected
+   if (!item->fDone && !fWorkBatch.empty()) {
+      fWorkPool->Submit(fWorkBatch);
+      fWorkBatch.clear();
    }
 
-   fRunRun.clear();
-   assert(fRunRun.size() == 0);
+   fWorkPool->Wait(item);
+   fWorkQueue.pop_front();
 
-   delete fRunInfo;
-   fRunInfo = NULL;
+   TAArena::SetCurrent(&item->fArena);
+   AnalyzeModules(item->fEvent, &item->fFlags, item->fWriter, item->fFlow);
+   TAArena::SetCurrent(NULL);
+   item->fArena.Reset();
+   item->fFlow = NULL;
+
+   if (item->fFlags & TAFlag_QUIT)
+      fWorkQuit = true;
+
+   fEventPool.DeleteEvent(item->fEvent);
+   item->fEvent = NULL;
+
+   fTiming.fEvent.Stop(item->fStartTime);
+
+   fWorkFree.push_back(item);
 }
 
-void RunHandler::AnalyzeSpecialEvent(TMEvent* event)
+void RunHandler::DrainWork()
 {
-   for (unsigned i=0; i<fRunRun.size(); i++)
-      fRunRun[i]->AnalyzeSpecialEvent(fRunInfo, event);
+   while (!fWorkQueue.empty())
+      FinishWork();
 }
 
-void RunHandler::AnalyzeEvent(TMEvent* event, TAFlags* flags, TMWriterInterface *writer)
+void RunHandler::AnalyzeEventView(const TMEventView* view, TAFlags* flags, TMWriterInterface *writer)
 {
    assert(fRunInfo != NULL);
    assert(fRunInfo->fOdb != NULL);
+   assert(fPipeline == NULL);
 
+   TAArena::SetCurrent(&fArena);
+
+   uint64_t start = TATiming::Start();
+   TMEvent* event = NULL; // copy of the event for modules without AnalyzeView()
    TAFlowEvent* flow = NULL;
 
+   // modules with AnalyzeView() do all of their work there
+   for (unsigned i=0; i<fRunRun.size(); i++) {
+      if (!fRunRun[i]->fParallel || fRunRun[i]->fEventView)
+         continue;
+      if (!event)
+         event = view->NewEvent();
+      uint64_t t0 = TATiming::Start();
+      flow = fRunRun[i]->AnalyzeParallel(fRunInfo, event, flags, flow);
+      fTiming.fAnalyzeParallel[i]->Stop(t0);
+      if (*flags & TAFlag_SKIP)
+         break;
+   }
+
    for (unsigned i=0; i<fRunRun.size(); i++) {
-      flow = fRunRun[i]->Analyze(fRunInfo, event, flags, flow);
+      if (*flags & TAFlag_SKIP)
+         break;
+      uint64_t t0 = TATiming::Start();
+      int64_t m0 = TAMemory::Start();
+      if (fRunRun[i]->fEventView) {
+         flow = fRunRun[i]->AnalyzeView(fRunInfo, view, flags, flow);
+      } else {
+         if (!event)
+            event = view->NewEvent();
+         flow = fRunRun[i]->Analyze(fRunInfo, event, flags, flow);
+      }
+      fMemory.Stop(i, m0);
+      fTiming.fAnalyze[i]->Stop(t0);
       if (*flags & TAFlag_SKIP)
          break;
    }
 
    if (flow && !(*flags & TAFlag_SKIP)) {
       for (unsigned i=0; i<fRunRun.size(); i++) {
+         uint64_t t0 = TATiming::Start();
          flow = fRunRun[i]->AnalyzeFlowEvent(fRunInfo, flags, flow);
+         fTiming.fAnalyzeFlow[i]->Stop(t0);
          if (*flags & TAFlag_SKIP)
             break;
       }
    }
 
    if (*flags & TAFlag_WRITE)
-      if (writer)
-         TMWriteEvent(writer, event);
+      if (writer) {
+         uint64_t t0 = TATiming::Start();
+         writer->Write(view->header, view->GetSize()); // same bytes as TMWriteEvent()
+         fTiming.fWrite.Stop(t0);
+      }
 
    if (flow)
       delete flow;
+
+   if (event)
+      delete event;
+
+   TAArena::SetCurrent(NULL);
+   fArena.Reset();
+
+   fTiming.fEvent.Stop(start);
+   if (TATiming::fgInterval > 0)
+      fTiming.PrintLive();
+   if (TAMemory::fgEnabled)
+      fMemory.Event();
+
+   RefreshDisplay();
+}
+
+void RunHandler::QueueEvent(TMEvent* event, TAFlags* flags, TMWriterInterface *writer)
+{
+   if (fWorkPool) {
+      TAWorkItem* item = NULL;
+      if (fWorkFree.empty()) {
+         item = new TAWorkItem;
+      } else {
+         item = fWorkFree.back();
+         fWorkFree.pop_back();
+      }
+
+      item->fEvent = event;
+      item->fFlow = NULL;
+      item->fFlags = 0;
+      item->fStartTime = TATiming::Start();
+      item->fWriter = writer;
+      item->fDone = false;
+
+      fWorkQueue.push_back(item);
+      fWorkBatch.push_back(item);
+
+      if ((int)fWorkBatch.size() >= gWorkBatch) {
+         fWorkPool->Submit(fWorkBatch);
+         fWorkBatch.clear();
+      }
+
+      // serial part in the order of the events, keep enough events
+      // queued for all workers
+      int max_backlog = 4*gWorkers*gWorkBatch;
+      while (!fWorkQueue.empty() && ((int)fWorkQueue.size() > max_backlog || fWorkQueue.front()->fDone))
+         FinishWork();
+
+      if (fWorkQuit)
+         *flags |= TAFlag_QUIT;
+      if (TATiming::fgInterval > 0)
+         fTiming.PrintLive();
+      if (TAMemory::fgEnabled)
+         fMemory.Event();
+      RefreshDisplay();
+      return;
+   }
+
+   if (fPipeline) {
+      fPipeline->Submit(event, writer);
+      if (fPipeline->fQuit)
+         *flags |= TAFlag_QUIT;
+      if (TATiming::fgInterval > 0)
+         fTiming.PrintLive();
+      if (TAMemory::fgEnabled)
+         fMemory.Event();
+      RefreshDisplay();
+      return;
+   }
+
+   AnalyzeEvent(event, flags, writer);
+   fEventPool.DeleteEvent(event);
+   RefreshDisplay();
 }
 
+void RunHandler::RefreshDisplay(bool force)
+{
+   // redraw only if someone can look at the canvases or histograms
+#ifdef HAVE_ROOT
+   if (!TARootHelper::fgApp && !TARootHelper::fgHttpServer && !TARootHelper::fgXmlServer)
+      return;
+#else
+   return;
+#endif
+
+   if (!fRunInfo || gRefreshInterval <= 0)
+      return;
+
+   double now = GetTimeSec();
+   if (!force && now - fLastRefresh < gRefreshInterval)
+      return;
+   fLastRefresh = now;
+
+   // histograms are filled by the pipeline threads,
+   // let them finish the queued events before drawing
+   if (fPipeline)
+      fPipeline->Drain();
+
+   DrainWork();
+
+#ifdef HAVE_ROOT
+   TAHistogram::FlushAll();
+#endif
+
+   for (unsigned i=0; i<fRunRun.size(); i++)
+      fRunRun[i]->RefreshDisplay(fRunInfo);
+}
 
 
 OnlineHandler::OnlineHandler(int num_analyze, TMWriterInterface* writer, const std::vector<std::string>& args) // ctor
@@ -403,11 +2239,12 @@ void OnlineHandler::Event(const void* data, int data_size)
       StartRun(0); // start fake run for events outside of a run
    }
 
-   TMEvent* event = new TMEvent(data, data_size);
+   TMEvent* event = fRun.fEventPool.NewEvent(data, data_size);
 
    TAFlags flags = 0;
 
-   fRun.AnalyzeEvent(event, &flags, fWriter);
+   fRun.QueueEvent(event, &flags, fWriter);
+   event = NULL; // returned to the pool by QueueEvent()
 
    if (flags & TAFlag_QUIT)
       fQuit = true;
@@ -426,6 +2263,12 @@ void OnlineHandler::Event(const void* data, int data_size)
 
 static int ProcessMidasOnline(const std::vector<std::string>& args, const char* hostname, const char* exptname, int num_analyze, TMWriterInterface* writer)
 {
+   if (gWorkers > 0) {
+      // events would wait in the worker pool until the next ones arrive
+      fprintf(stderr, "ERROR: --workers cannot be used online, running without workers\n");
+      gWorkers = 0;
+   }
+
    TMidasOnline *midas = TMidasOnline::instance();
 
    int err = midas->connect(hostname, exptname, "rootana");
@@ -464,6 +2307,7 @@ static int ProcessMidasOnline(const std::vector<std::string>& args, const char*
          gSystem->DispatchOneEvent(kTRUE);
       }
 #endif
+      h->fRun.RefreshDisplay(); // also when no events are coming
       if (!TMidasOnline::instance()->poll(10))
          break;
    }
@@ -483,6 +2327,24 @@ static int ProcessMidasOnline(const std::vector<std::string>& args, const char*
    return 0;
 }
 
+// analyze the collected events in one RunHandler::AnalyzeBatch(), true if a module asked to quit
+
+static bool AnalyzeBlock(RunHandler* run, std::vector<TMEvent*>* block, std::vector<TAFlags>* flags, TMWriterInterface* writer)
+{
+   if (block->empty())
+      return false;
+
+   flags->resize(block->size());
+   run->AnalyzeBatch(block->data(), block->size(), flags->data(), writer);
+   block->clear();
+
+   for (unsigned i=0; i<flags->size(); i++)
+      if ((*flags)[i] & TAFlag_QUIT)
+         return true;
+
+   return false;
+}
+
 static int ProcessMidasFiles(const std::vector<std::string>& files, const std::vector<std::string>& args, int num_skip, int num_analyze, TMWriterInterface* writer)
 {
    for (unsigned i=0; i<(*gModules).size(); i++)
@@ -492,131 +2354,170 @@ static int ProcessMidasFiles(const std::vector<std::string>& files, const std::v
 
    bool done = false;
 
-   for (unsigned i=0; i<files.size(); i++) {
-      std::string filename = files[i];
+   bool mmap = gMmap;
+   if (mmap && gMultithread) {
+      fprintf(stderr, "ERROR: --mmap cannot be used with --mt, reading files without mmap\n");
+      mmap = false;
+   }
 
-      TMReaderInterface *reader = TMNewReader(filename.c_str());
+   if (mmap && gWorkers > 0) {
+      fprintf(stderr, "ERROR: --mmap cannot be used with --workers, reading files without mmap\n");
+      mmap = false;
+   }
 
-      if (reader->fError) {
-         printf("Could not open \"%s\", error: %s\n", filename.c_str(), reader->fErrorString.c_str());
-         delete reader;
-         continue;
-      }
+   int batch = gBatchSize;
+   if (batch > 1 && (gMultithread || gWorkers > 0)) {
+      fprintf(stderr, "ERROR: --batch cannot be used with --mt or --workers, analyzing event by event\n");
+      batch = 0;
+   }
 
-      while (1) {
-         TMEvent* event = TMReadEvent(reader);
+   if (mmap && batch > 1) {
+      fprintf(stderr, "ERROR: --mmap cannot be used with --batch, reading files without mmap\n");
+      mmap = false;
+   }
 
-         if (!event) // EOF
-            break;
+   std::vector<TMEvent*> block; // data events for the next AnalyzeBatch()
+   std::vector<TAFlags> block_flags;
+
+   TAEventReader reader(files, gReadAheadDepth, mmap);
 
-         if (event->error) {
-            delete event;
+   while (1) {
+      int ifile = 0;
+      TMEvent* event = NULL;
+      TMEventView view;
+
+      uint64_t t0 = TATiming::Start();
+      if (!reader.Read(&ifile, &event, &view)) // EOF of last file
+         break;
+      run.fTiming.fRead.Stop(t0); // with --readahead, time spent waiting for the read-ahead thread
+
+      const std::string& filename = files[ifile];
+      int event_id = event ? event->event_id : view.event_id;
+      uint32_t serial_number = event ? event->serial_number : view.serial_number;
+
+      // the collected data events come before the special event,
+      // stop before the special event if a module asked to quit
+      if (event_id == 0x8000 || event_id == 0x8001 || event_id == 0x8002) {
+         if (AnalyzeBlock(&run, &block, &block_flags, writer)) {
+            if (event)
+               delete event;
             break;
          }
+      }
 
-         if (event->event_id == 0x8000) // begin of run event
-            {
-               int runno = event->serial_number;
-
-               if (run.fRunInfo) {
-                  if (run.fRunInfo->fRunNo == runno) {
-                     // next subrun file, nothing to do
-                     run.fRunInfo->fFileName = filename;
-                     run.NextSubrun();
-                  } else {
-                     // file with a different run number
-                     run.EndRun();
-                     run.DeleteRun();
-                  }
+      if (event_id == 0x8000) // begin of run event
+         {
+            int runno = event->serial_number;
+
+            if (run.fRunInfo) {
+               if (run.fRunInfo->fRunNo == runno) {
+                  // next subrun file, nothing to do
+                  run.fRunInfo->fFileName = filename;
+                  run.NextSubrun();
+               } else {
+                  // file with a different run number
+                  run.EndRun();
+                  run.DeleteRun();
                }
+            }
 
-               if (!run.fRunInfo) {
-                  run.CreateRun(runno, filename.c_str());
+            if (!run.fRunInfo) {
+               run.CreateRun(runno, filename.c_str());
 #ifdef HAVE_ROOT_XML
-                  run.fRunInfo->fOdb = new XmlOdb(event->GetEventData(), event->data_size);
+               run.fRunInfo->fOdb = new XmlOdb(event->GetEventData(), event->data_size);
 #else
-                  run.fRunInfo->fOdb = new EmptyOdb();
+               run.fRunInfo->fOdb = new EmptyOdb();
 #endif
-                  run.BeginRun();
-               }
+               run.BeginRun();
+            }
 
-               assert(run.fRunInfo);
+            assert(run.fRunInfo);
 
-               run.AnalyzeSpecialEvent(event);
+            run.AnalyzeSpecialEvent(event);
 
-               if (writer)
-                  TMWriteEvent(writer, event);
+            if (writer)
+               TMWriteEvent(writer, event);
+         }
+      else if (event_id == 0x8001) // end of run event
+         {
+            //int runno = event->serial_number;
+            run.AnalyzeSpecialEvent(event);
+            if (writer)
+               TMWriteEvent(writer, event);
+
+            if (run.fRunInfo->fOdb) {
+               delete run.fRunInfo->fOdb;
+               run.fRunInfo->fOdb = NULL;
             }
-         else if (event->event_id == 0x8001) // end of run event
-            {
-               //int runno = event->serial_number;
-               run.AnalyzeSpecialEvent(event);
-               if (writer)
-                  TMWriteEvent(writer, event);
-
-               if (run.fRunInfo->fOdb) {
-                  delete run.fRunInfo->fOdb;
-                  run.fRunInfo->fOdb = NULL;
-               }
 
 #ifdef HAVE_ROOT_XML
-               run.fRunInfo->fOdb = new XmlOdb(event->GetEventData(), event->data_size);
+            run.fRunInfo->fOdb = new XmlOdb(event->GetEventData(), event->data_size);
 #else
-               run.fRunInfo->fOdb = new EmptyOdb();
+            run.fRunInfo->fOdb = new EmptyOdb();
 #endif
+         }
+      else if (event_id == 0x8002) // message event
+         {
+            run.AnalyzeSpecialEvent(event);
+            if (writer)
+               TMWriteEvent(writer, event);
+         }
+      else
+         {
+            if (!run.fRunInfo) {
+               // create a fake begin of run
+               run.CreateRun(0, filename.c_str());
+               run.fRunInfo->fOdb = new EmptyOdb();
+               run.BeginRun();
             }
-         else if (event->event_id == 0x8002) // message event
-            {
-               run.AnalyzeSpecialEvent(event);
-               if (writer)
-                  TMWriteEvent(writer, event);
-            }
-         else
-            {
-               if (!run.fRunInfo) {
-                  // create a fake begin of run
-                  run.CreateRun(0, filename.c_str());
-                  run.fRunInfo->fOdb = new EmptyOdb();
-                  run.BeginRun();
-               }
 
-               if (num_skip > 0) {
-                  num_skip--;
+            if (num_skip > 0) {
+               num_skip--;
+               num_skip -= reader.SkipDataEvents(num_skip);
+            } else if (serial_number < gSkipToSerial) {
+               reader.SkipToSerial(gSkipToSerial);
+            } else {
+               TAFlags flags = 0;
+
+               if (batch > 1 && event) {
+                  block.push_back(event);
+                  event = NULL; // owned by AnalyzeBatch()
+                  if ((int)block.size() >= batch)
+                     if (AnalyzeBlock(&run, &block, &block_flags, writer))
+                        flags |= TAFlag_QUIT;
+               } else if (event) {
+                  run.QueueEvent(event, &flags, writer);
+                  event = NULL; // owned by QueueEvent()
                } else {
-                  TAFlags flags = 0;
+                  run.AnalyzeEventView(&view, &flags, writer);
+               }
 
-                  run.AnalyzeEvent(event, &flags, writer);
+               if (flags & TAFlag_QUIT)
+                  done = true;
 
-                  if (flags & TAFlag_QUIT)
+               if (num_analyze > 0) {
+                  num_analyze--;
+                  if (num_analyze == 0)
                      done = true;
-
-                  if (num_analyze > 0) {
-                     num_analyze--;
-                     if (num_analyze == 0)
-                        done = true;
-                  }
                }
             }
+         }
 
+      if (event)
          delete event;
 
-         if (done)
-            break;
+      if (done)
+         break;
 
 #ifdef HAVE_ROOT
-         if (TARootHelper::fgApp) {
-            gSystem->DispatchOneEvent(kTRUE);
-         }
-#endif
+      if (TARootHelper::fgApp) {
+         gSystem->DispatchOneEvent(kTRUE);
       }
-
-      reader->Close();
-      delete reader;
-
-      if (done)
-         break;
+#endif
    }
 
+   AnalyzeBlock(&run, &block, &block_flags, writer);
+
    if (run.fRunInfo) {
       run.EndRun();
       run.DeleteRun();
@@ -628,29 +2529,173 @@ static int ProcessMidasFiles(const std::vector<std::string>& files, const std::v
    return 0;
 }
 
-static bool gEnableShowMem = false;
+static int IndexMidasFiles(const std::vector<std::string>& files)
+{
+   for (unsigned i=0; i<files.size(); i++) {
+      const char* filename = files[i].c_str();
 
-#if 0
-static int ShowMem(const char* label)
+      if (!TMMappedFile::CanMap(filename)) {
+         printf("Cannot index \"%s\": only uncompressed .mid files can be indexed\n", filename);
+         continue;
+      }
+
+      TMEventIndex* idx = TMEventIndex::Build(filename);
+      if (!idx)
+         continue;
+
+      idx->Save();
+
+      std::vector<long> bor;
+      std::vector<long> eor;
+      idx->FindRunBoundaries(&bor, &eor);
+
+      printf("Index of \"%s\": %d events, %d data events", filename, (int)idx->fEntries.size(), (int)idx->fData.size());
+      for (unsigned j=0; j<bor.size(); j++)
+         printf(", begin of run %d at offset %llu", idx->fEntries[bor[j]].serial_number, (unsigned long long)idx->fEntries[bor[j]].offset);
+      for (unsigned j=0; j<eor.size(); j++)
+         printf(", end of run %d at offset %llu", idx->fEntries[eor[j]].serial_number, (unsigned long long)idx->fEntries[eor[j]].offset);
+      printf("\n");
+
+      delete idx;
+   }
+
+   return 0;
+}
+
+#ifdef HAVE_ROOT
+static int MergeParallelOutput(int tag)
 {
-   if (!gEnableShowMem)
-      return 0;
+   // collect the per-worker output files and merge them
+   // into one output file per run
 
-   FILE* fp = fopen("/proc/self/statm","r");
-   if (!fp)
+   char pattern[256];
+   sprintf(pattern, "output*.part%d-*.root", tag);
+
+   glob_t g;
+   if (glob(pattern, 0, NULL, &g) != 0) {
+      printf("No worker output files matching \"%s\"\n", pattern);
       return 0;
+   }
 
-   int mem = 0;
-   fscanf(fp,"%d",&mem);
-   fclose(fp);
+   std::map<int, std::vector<std::string> > parts;
+
+   for (size_t i=0; i<g.gl_pathc; i++) {
+      int runno = 0;
+      if (sscanf(g.gl_pathv[i], "output%d.part", &runno) == 1)
+         parts[runno].push_back(g.gl_pathv[i]);
+   }
+
+   globfree(&g);
+
+   int errors = 0;
 
-   if (label)
-      printf("memory at %s is %d\n", label, mem);
+   for (std::map<int, std::vector<std::string> >::iterator it = parts.begin(); it != parts.end(); it++) {
+      char xfilename[1024];
+      sprintf(xfilename, TARootHelper::fgOutputFileFormat.c_str(), it->first);
 
-   return mem;
+      printf("Merging %d worker output files into %s\n", (int)it->second.size(), xfilename);
+
+      TFileMerger merger(kFALSE);
+      merger.OutputFile(xfilename, "RECREATE");
+      for (unsigned i=0; i<it->second.size(); i++)
+         merger.AddFile(it->second[i].c_str(), kFALSE);
+
+      if (!merger.Merge()) {
+         fprintf(stderr, "ERROR: Cannot merge worker output files into %s, keeping the worker files\n", xfilename);
+         errors++;
+         continue;
+      }
+
+      for (unsigned i=0; i<it->second.size(); i++)
+         unlink(it->second[i].c_str());
+   }
+
+   return errors;
 }
 #endif
 
+static int ProcessMidasFilesParallel(const std::vector<std::string>& files, const std::vector<std::string>& args, int num_jobs)
+{
+   // each file is analyzed by a forked worker process with its own RunHandler,
+   // worker output files are merged at the end, the ROOT files here, other
+   // files by TAFactory::MergeParallel() of the modules that wrote them
+
+   int tag = getpid();
+   unsigned next = 0;
+   int running = 0;
+   int failed = 0;
+
+   while (next < files.size() || running > 0) {
+      if (next < files.size() && running < num_jobs) {
+         char part[256];
+         sprintf(part, ".part%d-%04d", tag, next);
+         std::string format = std::string("output%05d") + part + ".root";
+
+         fflush(stdout);
+         fflush(stderr);
+
+         pid_t pid = fork();
+
+         if (pid == 0) { // worker process
+            TALog::Start();
+#ifdef HAVE_ROOT
+            TARootHelper::fgOutputFileFormat = format;
+            TARootHelper::fgOutputPart = part;
+#endif
+            std::vector<std::string> unit;
+            unit.push_back(files[next]);
+            int status = ProcessMidasFiles(unit, args, 0, 0, NULL);
+            TALog::Stop();
+            fflush(stdout);
+            fflush(stderr);
+            _exit(status);
+         }
+
+         if (pid < 0) {
+            fprintf(stderr, "ERROR: Cannot fork() worker for file \"%s\", errno %d (%s)\n", files[next].c_str(), errno, strerror(errno));
+            failed++;
+            next++;
+            continue;
+         }
+
+         printf("Worker pid %d: file[%d]: %s\n", (int)pid, next, files[next].c_str());
+
+         next++;
+         running++;
+         continue;
+      }
+
+      int status = 0;
+      pid_t pid = wait(&status);
+
+      if (pid < 0) {
+         fprintf(stderr, "ERROR: wait() error, errno %d (%s)\n", errno, strerror(errno));
+         break;
+      }
+
+      running--;
+
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+         fprintf(stderr, "ERROR: Worker pid %d failed, status 0x%x\n", (int)pid, status);
+         failed++;
+      }
+   }
+
+#ifdef HAVE_ROOT
+   failed += MergeParallelOutput(tag);
+#endif
+
+   char part[256];
+   sprintf(part, ".part%d-", tag);
+   for (unsigned i=0; i<(*gModules).size(); i++)
+      failed += (*gModules)[i]->MergeParallel(part);
+
+   if (failed)
+      return -1;
+
+   return 0;
+}
+
 // ==================== EventDumpModule Methods ==================== //
 
 EventDumpModule::EventDumpModule(TARunInfo* runinfo)
@@ -1089,10 +3134,31 @@ static void help()
    printf("                         (for use with roody -Plocalhost:9091)\n");
    printf("   -e <NNN>            - Number of events to analyze\n");
    printf("   -s <NNN>            - Number of events to skip before starting analysis\n");
+   printf("                         (with --mmap, indexed files are skipped by seeking)\n");
+   printf("   --serial<NNN>       - Skip data events with serial number below NNN\n");
+   printf("   --index             - Write event index files (.mid.idx) for uncompressed data files and exit\n");
    printf("   -t                  - Enable tracing of constructors, destructors and function calls\n");
-   printf("   -m                  - Enable memory leak debugging\n");
+   printf("   -m<NNN>             - Enable memory leak debugging: print RSS every NNN events (default %d),\n", TAMemory::fgInterval);
+   printf("                         memory used by each module at the end of each run\n");
+   printf("   --memwarn<NNN>      - With -m, warn if RSS grows by more than NNN kB per 10000 events (default %d, 0 to disable)\n", TAMemory::fgWarnKB);
    printf("   -g                  - Enable graphics display when processing data files\n");
    printf("   -i                  - Enable intractive mode\n");
+   printf("   --refresh<NNN>      - With -g or -R, redraw the canvases every NNN seconds (default %.0f), 0 to disable\n", gRefreshInterval);
+   printf("   -j<NNN>             - Analyze data files in NNN parallel worker processes, merge the output,\n");
+   printf("                         not with -o, -s, -e, -g, -i, -P, -X and -R\n");
+   printf("   --readahead<NNN>    - Read and decompress up to NNN events ahead on a separate thread\n");
+   printf("   --writebuffer<NNN>  - With -o, queue up to NNN Mbytes of output for a separate writer thread (default %d), 0 to write synchronously\n", gWriteBufferMB);
+   printf("   --mmap              - Map uncompressed .mid files into memory, analyze events without copying them\n");
+   printf("   --mt                - Enable multithreaded mode: each module runs in its own thread\n");
+   printf("   --mtql<NNN>         - Maximum number of events queued in multithreaded mode (default %d)\n", gMtMaxBacklog);
+   printf("   --workers<NNN>      - Run the parallel part of the modules (AnalyzeParallel()) for many events at once on NNN threads\n");
+   printf("   --workbatch<NNN>    - With --workers, give the events to the threads in batches of NNN (default %d)\n", gWorkBatch);
+   printf("   --batch<NNN>        - Analyze data files in blocks of NNN events, modules with AnalyzeBatch() get a whole block at once\n");
+   printf("   --timing            - Measure the time spent in each module, print a table at the end of each run\n");
+   printf("   --timing<NNN>       - Same, also print the table every NNN seconds during the run\n");
+   printf("   --log-level=<level> - Print messages up to this level: error, warning, info (default), debug (per event), trace (per hit)\n");
+   printf("   --log=<category>    - Print all messages of this category (i.e. emma.tdc, emma.adc), \"all\" for all categories\n");
+   printf("   --log-rate=<NNN>    - Print at most NNN messages per second with the same format (default %d, 0 for unlimited)\n", TALog::fgRateLimit);
    printf("   --dump              - activate the event dump module\n");
    printf("   --                  - All following arguments are passed to the analyzer modules Init() method\n");
    printf("\n");
@@ -1105,7 +3171,9 @@ static void help()
 
 int manalyzer_main(int argc, char *argv[])
 {
-   setbuf(stdout, NULL);
+   // event loop messages go through TALog, stdout does not need
+   // to be unbuffered, line buffering keeps it in order with stderr
+   setvbuf(stdout, NULL, _IOLBF, 0);
    setbuf(stderr, NULL);
 
    signal(SIGILL,  SIG_DFL);
@@ -1128,10 +3196,12 @@ int manalyzer_main(int argc, char *argv[])
 
    int num_skip = 0;
    int num_analyze = 0;
+   int num_jobs = 0;
 
    TMWriterInterface *writer = NULL;
 
    bool event_dump = false;
+   bool index_files = false;
    bool root_graphics = false;
    bool interactive = false;
 
@@ -1152,6 +3222,42 @@ int manalyzer_main(int argc, char *argv[])
          root_graphics = true;
       } else if (args[i] == "-i") {
          interactive = true;
+      } else if (args[i] == "--index") {
+         index_files = true;
+      } else if (strncmp(arg,"--serial",8)==0) {
+         gSkipToSerial = strtoul(arg+8, NULL, 0);
+      } else if (strncmp(arg,"--log-level=",12)==0) {
+         int level = TALog::ParseLevel(arg+12);
+         if (level < 0)
+            help(); // does not return
+         TALog::fgLevel = level;
+      } else if (strncmp(arg,"--log-rate=",11)==0) {
+         TALog::fgRateLimit = atoi(arg+11);
+      } else if (strncmp(arg,"--log=",6)==0) {
+         TALog::EnableCategory(arg+6);
+      } else if (strncmp(arg,"--timing",8)==0) {
+         TATiming::fgEnabled = true;
+         TATiming::fgInterval = atof(arg+8);
+      } else if (strncmp(arg,"--refresh",9)==0) {
+         gRefreshInterval = atof(arg+9);
+      } else if (args[i] == "--mmap") {
+         gMmap = true;
+      } else if (args[i] == "--mt") {
+         gMultithread = true;
+      } else if (strncmp(arg,"--mtql",6)==0) {
+         gMtMaxBacklog = atoi(arg+6);
+      } else if (strncmp(arg,"--workers",9)==0) {
+         gWorkers = atoi(arg+9);
+      } else if (strncmp(arg,"--batch",7)==0) {
+         gBatchSize = atoi(arg+7);
+      } else if (strncmp(arg,"--workbatch",11)==0) {
+         gWorkBatch = atoi(arg+11);
+         if (gWorkBatch < 1)
+            gWorkBatch = 1;
+      } else if (strncmp(arg,"--readahead",11)==0) {
+         gReadAheadDepth = atoi(arg+11);
+      } else if (strncmp(arg,"--writebuffer",13)==0) {
+         gWriteBufferMB = atoi(arg+13);
       } else if (args[i] == "-t") {
          gTrace = true;
          TMReaderInterface::fgTrace = true;
@@ -1162,8 +3268,14 @@ int manalyzer_main(int argc, char *argv[])
          num_skip = atoi(arg+2);
       } else if (strncmp(arg,"-e",2)==0) {
          num_analyze = atoi(arg+2);
+      } else if (strncmp(arg,"-j",2)==0) {
+         num_jobs = atoi(arg+2);
+      } else if (strncmp(arg,"--memwarn",9)==0) {
+         TAMemory::fgWarnKB = atoi(arg+9);
       } else if (strncmp(arg,"-m",2)==0) { // Enable memory debugging
-         gEnableShowMem = true;
+         TAMemory::fgEnabled = true;
+         if (arg[2])
+            TAMemory::fgInterval = atoi(arg+2);
       } else if (strncmp(arg,"-P",2)==0) { // Set the histogram server port
          tcpPort = atoi(arg+2);
       } else if (strncmp(arg,"-X",2)==0) { // Set the histogram server port
@@ -1183,6 +3295,10 @@ int manalyzer_main(int argc, char *argv[])
       }
    }
 
+   if (index_files) {
+      return IndexMidasFiles(files);
+   }
+
    if (!gModules)
       gModules = new std::vector<TAFactory*>;
 
@@ -1197,7 +3313,23 @@ int manalyzer_main(int argc, char *argv[])
 
    printf("Registered modules: %d\n", (int)(*gModules).size());
 
+   // the histograms of the -j workers only exist in the forked processes,
+   // there is nothing to display or to serve before they are merged
+   if (num_jobs > 1 && (writer || num_skip > 0 || num_analyze > 0 || root_graphics || interactive || tcpPort || xmlTcpPort || httpPort)) {
+      fprintf(stderr, "ERROR: -j cannot be used with -o, -s, -e, -g, -i, -P, -X and -R, analyzing the files serially\n");
+      num_jobs = 0;
+   }
+
+   if (gMultithread && gWorkers > 0) {
+      fprintf(stderr, "ERROR: --workers cannot be used with --mt, running without workers\n");
+      gWorkers = 0;
+   }
+
 #ifdef HAVE_ROOT
+   if (gMultithread || gWorkers > 0) {
+      ROOT::EnableThreadSafety();
+   }
+
    if (root_graphics) {
       TARootHelper::fgApp = new TApplication("manalyzer", NULL, NULL, 0, 0);
    }
@@ -1246,7 +3378,17 @@ int manalyzer_main(int argc, char *argv[])
       printf("file[%d]: %s\n", i, files[i].c_str());
    }
 
-   if (files.size() > 0) {
+   if (writer && gWriteBufferMB > 0)
+      writer = new TAAsyncWriter(writer, (size_t)gWriteBufferMB*1024*1024);
+
+   if (!(files.size() > 0 && num_jobs > 1)) {
+      // parallel workers start their own output thread after fork()
+      TALog::Start();
+   }
+
+   if (files.size() > 0 && num_jobs > 1) {
+      ProcessMidasFilesParallel(files, modargs, num_jobs);
+   } else if (files.size() > 0) {
       ProcessMidasFiles(files, modargs, num_skip, num_analyze, writer);
    } else {
 #ifdef HAVE_MIDAS
@@ -1254,13 +3396,20 @@ int manalyzer_main(int argc, char *argv[])
 #endif
    }
 
+   int status = 0;
+
    if (writer) {
-      writer->Close();
+      if (writer->Close() < 0) {
+         fprintf(stderr, "ERROR: Cannot write the output file, it is incomplete\n");
+         status = 1;
+      }
       delete writer;
       writer = NULL;
    }
 
-   return 0;
+   TALog::Stop();
+
+   return status;
 }
 
 /* emacs
@@ -2,14 +2,29 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "mesadc32unpack.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_MESADC32_SIMD 1
+#include <immintrin.h>
+#endif
+
 mesadc32event::mesadc32event() // ctor
 {
    error = false;
 }
 
+void mesadc32event::Reset()
+{
+   error = false;
+   module_id = 0;
+   nwords32 = 0;
+   time_stamp = 0;
+   hits.clear();
+}
+
 void mesadc32event::Print() const
 {
    printf("mesadc32event: error %d, module_id %d, nwords32 %d, timestamp 0x%08x\n",
@@ -22,59 +37,255 @@ void mesadc32event::Print() const
    }
 };
 
+void mesadc32result::Print() const
+{
+   printf("mesadc32result: error %d, module_id %d, nwords32 %d, timestamp 0x%08x\n",
+          error,
+          module_id,
+          nwords32,
+          time_stamp);
+   for (int i=0; i<nhits; i++) {
+      printf("mesadc32hit[%2d], channel %2d, overflow %d, adc_data %5d\n", i, channel[i], v[i], adc_data[i]);
+   }
+}
+
 mesadc32event* UnpackMesadc32(const char** data8, int* datalen, bool verbose)
+{
+   mesadc32event* e = new mesadc32event();
+   UnpackMesadc32(data8, datalen, verbose, e);
+   return e;
+}
+
+void UnpackMesadc32(const char** data8, int* datalen, bool verbose, mesadc32event* e)
+{
+   mesadc32buffer buf;
+   mesadc32result r = DecodeMesadc32(data8, datalen, &buf, verbose);
+
+   e->error = r.error;
+   e->module_id = r.module_id;
+   e->nwords32 = r.nwords32;
+   e->time_stamp = r.time_stamp;
+   e->hits.resize(r.nhits);
+   for (int i=0; i<r.nhits; i++) {
+      e->hits[i].channel = r.channel[i];
+      e->hits[i].v = r.v[i];
+      e->hits[i].adc_data = r.adc_data[i];
+   }
+}
+
+static int DecodeWordsScalar(const uint32_t* data, int start, int count, mesadc32buffer* buf)
+{
+   int i;
+   for (i=start; i<count; i++) {
+      uint32_t w = data[i];
+      if ((w>>30) != 0x0) // not a data word
+         break;
+      buf->channel[i] = (w>>16)&0x1F; // 5 bits
+      buf->v[i] = (w>>15)&0x1; // 1 bit
+      buf->adc_data[i] = (w>>0)&0xFFF; // 12 bits
+   }
+   return i;
+}
+
+#ifdef HAVE_MESADC32_SIMD
+
+__attribute__((target("avx2")))
+static int DecodeWordsAvx2(const uint32_t* data, int count, mesadc32buffer* buf)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i mask_chan = _mm256_set1_epi32(0x1F);
+   const __m256i mask_v = _mm256_set1_epi32(0x1);
+   const __m256i mask_adc = _mm256_set1_epi32(0xFFF);
+
+   int i = 0;
+   for (; i+8 <= count; i+=8) {
+      __m256i w = _mm256_loadu_si256((const __m256i*)(data+i));
+
+      // data words have marker 0 in the top 2 bits
+      __m256i isdata = _mm256_cmpeq_epi32(_mm256_srli_epi32(w, 30), zero);
+      unsigned m = _mm256_movemask_ps(_mm256_castsi256_ps(isdata));
+
+      __m256i chan = _mm256_and_si256(_mm256_srli_epi32(w, 16), mask_chan);
+      __m256i v    = _mm256_and_si256(_mm256_srli_epi32(w, 15), mask_v);
+      __m256i adc  = _mm256_and_si256(w, mask_adc);
+
+      // pack 8x32 bits into 8x16 bits: packus works per 128-bit lane, permute the lanes back in order
+      __m128i adc16  = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(adc, adc), 0x08));
+      __m128i chan16 = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(chan, chan), 0x08));
+      __m128i v16    = _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08));
+
+      _mm_storeu_si128((__m128i*)(buf->adc_data+i), adc16);
+      _mm_storel_epi64((__m128i*)(buf->channel+i), _mm_packus_epi16(chan16, chan16));
+      _mm_storel_epi64((__m128i*)(buf->v+i), _mm_packus_epi16(v16, v16));
+
+      if (m != 0xFF) // stop at the first word that is not a data word
+         return i + __builtin_ctz(~m);
+   }
+
+   return DecodeWordsScalar(data, i, count, buf);
+}
+
+__attribute__((target("sse4.2")))
+static int DecodeWordsSse42(const uint32_t* data, int count, mesadc32buffer* buf)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i mask_chan = _mm_set1_epi32(0x1F);
+   const __m128i mask_v = _mm_set1_epi32(0x1);
+   const __m128i mask_adc = _mm_set1_epi32(0xFFF);
+
+   int i = 0;
+   for (; i+4 <= count; i+=4) {
+      __m128i w = _mm_loadu_si128((const __m128i*)(data+i));
+
+      // data words have marker 0 in the top 2 bits
+      __m128i isdata = _mm_cmpeq_epi32(_mm_srli_epi32(w, 30), zero);
+      unsigned m = _mm_movemask_ps(_mm_castsi128_ps(isdata));
+
+      __m128i chan = _mm_and_si128(_mm_srli_epi32(w, 16), mask_chan);
+      __m128i v    = _mm_and_si128(_mm_srli_epi32(w, 15), mask_v);
+      __m128i adc  = _mm_and_si128(w, mask_adc);
+
+      __m128i adc16  = _mm_packus_epi32(adc, adc);
+      __m128i chan16 = _mm_packus_epi32(chan, chan);
+      __m128i v16    = _mm_packus_epi32(v, v);
+
+      _mm_storel_epi64((__m128i*)(buf->adc_data+i), adc16);
+      int chan8 = _mm_cvtsi128_si32(_mm_packus_epi16(chan16, chan16));
+      int v8    = _mm_cvtsi128_si32(_mm_packus_epi16(v16, v16));
+      memcpy(buf->channel+i, &chan8, 4);
+      memcpy(buf->v+i, &v8, 4);
+
+      if (m != 0xF) // stop at the first word that is not a data word
+         return i + __builtin_ctz(~m);
+   }
+
+   return DecodeWordsScalar(data, i, count, buf);
+}
+
+#endif
+
+static int DecodeWordsGeneric(const uint32_t* data, int count, mesadc32buffer* buf)
+{
+   return DecodeWordsScalar(data, 0, count, buf);
+}
+
+typedef int (*DecodeWordsFunc)(const uint32_t* data, int count, mesadc32buffer* buf);
+
+static DecodeWordsFunc SelectDecodeWords()
+{
+#ifdef HAVE_MESADC32_SIMD
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      return DecodeWordsAvx2;
+   if (__builtin_cpu_supports("sse4.2"))
+      return DecodeWordsSse42;
+#endif
+   return DecodeWordsGeneric;
+}
+
+int DecodeMesadc32Words(const uint32_t* words, int count, mesadc32buffer* buf)
+{
+   static const DecodeWordsFunc func = SelectDecodeWords();
+
+   if (count > MESADC32_MAX_HITS)
+      count = MESADC32_MAX_HITS;
+
+   return func(words, count, buf);
+}
+
+template<class Policy>
+mesadc32result DecodeMesadc32T(const char** data8, int* datalen, mesadc32buffer* buf)
 {
    const uint32_t *data = (const uint32_t*)(*data8);
    int count = (*datalen)/4;
 
-   mesadc32event* e = new mesadc32event();
+   mesadc32result r;
+   r.error = false;
+   r.module_id = 0;
+   r.nwords32 = 0;
+   r.time_stamp = 0;
+   r.nhits = 0;
+   r.channel = buf->channel;
+   r.v = buf->v;
+   r.adc_data = buf->adc_data;
 
    // ADC data is: event header, optional data words and an end of event word
 
-   if (verbose) {
+   if (Policy::kVerbose) {
       printf("datalen %d, count %d, header 0x%08x\n", *datalen, count, data[0]);
    }
 
    // less than 2 words
    if (count < 2) {
-      e->error = true;
+      r.error = true;
+      if (Policy::kStrict) {
+         printf("mesadc32: event is too short, %d words\n", count);
+      }
       // consume all words
       *data8 += *datalen;
       *datalen -= *datalen;
-      return e;
+      return r;
    }
 
    if ((data[0]>>30) != 0x1) { // header marker
-      e->error = true;
+      r.error = true;
+      if (Policy::kStrict) {
+         printf("mesadc32: word 0x%08x is not an event header\n", data[0]);
+      }
       // first word is not a header, consume it
       *data8 += 4;
       *datalen -= 4;
-      return e;
+      return r;
    }
 
-   e->module_id = (data[0]>>16)&0xFF; // 8 bits
-   e->nwords32 = (data[0]>>0)&0xFFF; // 12 bits
+   if (Policy::kStrict) {
+      if (((data[0]>>24)&0x3F) != 0x00) { // header signature
+         r.error = true;
+         printf("mesadc32: bad header signature 0x%08x\n", data[0]);
+      }
+   }
+
+   r.module_id = (data[0]>>16)&0xFF; // 8 bits
+   r.nwords32 = (data[0]>>0)&0xFFF; // 12 bits
 
    data++;
    count--;
    *data8 += 4;
    *datalen -= 4;
 
-   int nw32 = e->nwords32;
+   int nw32 = r.nwords32;
 
-   if (count < e->nwords32) {
-      e->error = true;
+   if (count < r.nwords32) {
+      r.error = true;
+      if (Policy::kStrict) {
+         printf("mesadc32: header says %d words, only %d words left\n", r.nwords32, count);
+      }
       // too few data words
       nw32 = count;
    }
 
-   if (verbose) {
+   if (Policy::kVerbose) {
       printf("datalen %d, count %d, nw32 %d\n", *datalen, count, nw32);
    }
 
+   if (Policy::kVectorized) {
+      // decode the data words in one go
+      int n = nw32;
+      if (n > MESADC32_MAX_HITS)
+         n = MESADC32_MAX_HITS;
+      r.nhits = DecodeMesadc32Words(data, n, buf);
+      data += r.nhits;
+      count -= r.nhits;
+      *data8 += 4*r.nhits;
+      *datalen -= 4*r.nhits;
+      nw32 -= r.nhits;
+      if (r.nhits < n)
+         nw32 = 0; // stopped at a word that is not a data word
+   }
+
    for (int i=0; i<nw32; i++) {
 
-      if (verbose) {
+      if (Policy::kVerbose) {
          printf("data[%d] is 0x%08x\n", i, data[0]);
       }
 
@@ -83,11 +294,25 @@ mesadc32event* UnpackMesadc32(const char** data8, int* datalen, bool verbose)
          break;
       }
 
-      mesadc32hit h;
-      h.channel = (data[0]>>16)&0x1F; // 5 bits
-      h.v = (data[0]>>15)&0x1; // 1 bit
-      h.adc_data = (data[0]>>0)&0xFFF; // 12 bits
-      e->hits.push_back(h);
+      if (Policy::kStrict) {
+         if (((data[0]>>24)&0x3F) != 0x04) { // data event signature
+            r.error = true;
+            printf("mesadc32: word 0x%08x is not an adc data word\n", data[0]);
+         }
+      }
+
+      if (r.nhits < MESADC32_MAX_HITS) {
+         buf->channel[r.nhits] = (data[0]>>16)&0x1F; // 5 bits
+         buf->v[r.nhits] = (data[0]>>15)&0x1; // 1 bit
+         buf->adc_data[r.nhits] = (data[0]>>0)&0xFFF; // 12 bits
+         r.nhits++;
+      } else {
+         r.error = true;
+         if (Policy::kStrict) {
+            printf("mesadc32: too many data words, dropped hit 0x%08x\n", data[0]);
+         }
+         // too many data words, drop the extra hits
+      }
 
       data++;
       count--;
@@ -95,34 +320,69 @@ mesadc32event* UnpackMesadc32(const char** data8, int* datalen, bool verbose)
       *datalen -= 4;
    }
 
-   if (verbose) {
+   if (Policy::kVerbose) {
       printf("datalen %d, count %d, footer 0x%08x\n", *datalen, count, data[0]);
    }
 
    if (count < 1) {
-      e->error = true;
+      r.error = true;
+      if (Policy::kStrict) {
+         printf("mesadc32: end of event word is missing\n");
+      }
       // too few data words, end of event word is missing?
-      return e;
+      return r;
    }
 
    if ((data[0]>>30) != 0x3) { // end of event marker
-      e->error = true;
+      r.error = true;
+      if (Policy::kStrict) {
+         printf("mesadc32: word 0x%08x is not an end of event word\n", data[0]);
+      }
       // last word is not a footer
-      return e;
+      return r;
    }
 
-   e->time_stamp = data[0]&0x3FFFFFFF;
+   if (Policy::kStrict) {
+      // the header word count includes the end of event word
+      if (r.nhits + 1 != r.nwords32) {
+         r.error = true;
+         printf("mesadc32: header says %d words, found %d hits and end of event\n", r.nwords32, r.nhits);
+      }
+   }
+
+   r.time_stamp = data[0]&0x3FFFFFFF;
 
    data++;
    count--;
    *data8 += 4;
    *datalen -= 4;
 
-   if (verbose) {
+   if (Policy::kVerbose) {
       printf("datalen %d, count %d, done\n", *datalen, count);
    }
 
-   return e;
+   return r;
+}
+
+template mesadc32result DecodeMesadc32T<Mesadc32Production>(const char** data, int* datalen, mesadc32buffer* buf);
+template mesadc32result DecodeMesadc32T<Mesadc32Verbose>(const char** data, int* datalen, mesadc32buffer* buf);
+template mesadc32result DecodeMesadc32T<Mesadc32Strict>(const char** data, int* datalen, mesadc32buffer* buf);
+
+mesadc32result DecodeMesadc32(const char** data, int* datalen, mesadc32buffer* buf, bool verbose)
+{
+   if (verbose)
+      return DecodeMesadc32T<Mesadc32Verbose>(data, datalen, buf);
+   else
+      return DecodeMesadc32T<Mesadc32Production>(data, datalen, buf);
+}
+
+Mesadc32DecodeFunc SelectMesadc32Decoder(bool verbose, bool strict)
+{
+   if (verbose)
+      return DecodeMesadc32T<Mesadc32Verbose>;
+   if (strict)
+      return DecodeMesadc32T<Mesadc32Strict>;
+   return DecodeMesadc32T<Mesadc32Production>;
 }
 
 //end
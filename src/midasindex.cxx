@@ -0,0 +1,229 @@
+// midasindex.cxx
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#include "midasindex.h"
+
+#define TMINDEX_MAGIC "TMIDX001"
+
+struct TMIndexHeader
+{
+   char magic[8];
+   uint64_t file_size;
+   int64_t  file_mtime;
+   uint64_t num_entries;
+};
+
+TMEventIndex::TMEventIndex(const char* filename) // ctor
+{
+   fFilename = filename;
+   fFileSize = 0;
+   fFileMtime = 0;
+
+   struct stat st;
+   if (stat(filename, &st) == 0) {
+      fFileSize = st.st_size;
+      fFileMtime = st.st_mtime;
+   }
+}
+
+void TMEventIndex::Add(const TMEventView* view)
+{
+   TMIndexEntry e;
+   e.offset = view->offset;
+   e.serial_number = view->serial_number;
+   e.event_id = view->event_id;
+   e.trigger_mask = view->trigger_mask;
+   e.data_size = view->data_size;
+   e.reserved = 0;
+
+   if (e.event_id & 0x8000)
+      fSpecial.push_back(fEntries.size());
+   else
+      fData.push_back(fEntries.size());
+
+   fEntries.push_back(e);
+}
+
+bool TMEventIndex::Load()
+{
+   std::string idxname = IndexFilename(fFilename.c_str());
+
+   FILE* fp = fopen(idxname.c_str(), "r");
+   if (!fp)
+      return false;
+
+   TMIndexHeader h;
+   if (fread(&h, sizeof(h), 1, fp) != 1
+       || memcmp(h.magic, TMINDEX_MAGIC, 8) != 0
+       || h.file_size != fFileSize
+       || h.file_mtime != fFileMtime) {
+      printf("TMEventIndex: ignoring out of date index file \"%s\"\n", idxname.c_str());
+      fclose(fp);
+      return false;
+   }
+
+   fEntries.resize(h.num_entries);
+
+   if (h.num_entries > 0 && fread(&fEntries[0], sizeof(TMIndexEntry), h.num_entries, fp) != h.num_entries) {
+      printf("TMEventIndex: truncated index file \"%s\"\n", idxname.c_str());
+      fEntries.clear();
+      fclose(fp);
+      return false;
+   }
+
+   fclose(fp);
+
+   fData.clear();
+   fSpecial.clear();
+
+   for (unsigned i=0; i<fEntries.size(); i++) {
+      if (fEntries[i].event_id & 0x8000)
+         fSpecial.push_back(i);
+      else
+         fData.push_back(i);
+   }
+
+   return true;
+}
+
+bool TMEventIndex::Save()
+{
+   std::string idxname = IndexFilename(fFilename.c_str());
+   std::string tmpname = idxname + ".tmp";
+
+   FILE* fp = fopen(tmpname.c_str(), "w");
+   if (!fp) {
+      printf("TMEventIndex: cannot write index file \"%s\"\n", tmpname.c_str());
+      return false;
+   }
+
+   TMIndexHeader h;
+   memcpy(h.magic, TMINDEX_MAGIC, 8);
+   h.file_size = fFileSize;
+   h.file_mtime = fFileMtime;
+   h.num_entries = fEntries.size();
+
+   bool ok = (fwrite(&h, sizeof(h), 1, fp) == 1);
+   if (ok && h.num_entries > 0)
+      ok = (fwrite(&fEntries[0], sizeof(TMIndexEntry), h.num_entries, fp) == h.num_entries);
+   if (fclose(fp) != 0)
+      ok = false;
+
+   if (!ok || rename(tmpname.c_str(), idxname.c_str()) != 0) {
+      printf("TMEventIndex: cannot write index file \"%s\"\n", idxname.c_str());
+      remove(tmpname.c_str());
+      return false;
+   }
+
+   return true;
+}
+
+TMEventIndex* TMEventIndex::Build(const char* filename)
+{
+   TMMappedFile f(filename);
+
+   if (f.fError) {
+      printf("TMEventIndex: cannot map \"%s\", error: %s\n", filename, f.fErrorString.c_str());
+      return NULL;
+   }
+
+   TMEventIndex* idx = new TMEventIndex(filename);
+
+   TMEventView view;
+   while (f.ReadEvent(&view))
+      idx->Add(&view);
+
+   return idx;
+}
+
+static bool OffsetLess(const TMIndexEntry& e, uint64_t offset)
+{
+   return e.offset < offset;
+}
+
+long TMEventIndex::FindOffset(uint64_t offset) const
+{
+   return std::lower_bound(fEntries.begin(), fEntries.end(), offset, OffsetLess) - fEntries.begin();
+}
+
+long TMEventIndex::FindSerial(uint32_t serial_number) const
+{
+   // serial numbers of data events increase through the file
+   long lo = 0;
+   long hi = fData.size();
+   while (lo < hi) {
+      long mid = (lo + hi)/2;
+      if (fEntries[fData[mid]].serial_number < serial_number)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo == (long)fData.size())
+      return fEntries.size();
+
+   return fData[lo];
+}
+
+long TMEventIndex::CountData(long entry) const
+{
+   return std::lower_bound(fData.begin(), fData.end(), (uint32_t)entry) - fData.begin();
+}
+
+uint64_t TMEventIndex::Skip(uint64_t offset, int num_skip, int* skipped) const
+{
+   long cur = FindOffset(offset);
+
+   // first data event and first special event at or after the current position
+   long d = CountData(cur);
+   long s = std::lower_bound(fSpecial.begin(), fSpecial.end(), (uint32_t)cur) - fSpecial.begin();
+
+   long target = fEntries.size();
+   if (d + num_skip < (long)fData.size())
+      target = fData[d + num_skip];
+   if (s < (long)fSpecial.size() && (long)fSpecial[s] < target)
+      target = fSpecial[s];
+
+   *skipped = CountData(target) - d;
+
+   if (target == (long)fEntries.size())
+      return fFileSize;
+
+   return fEntries[target].offset;
+}
+
+uint64_t TMEventIndex::SkipToSerial(uint64_t offset, uint32_t serial_number, int* skipped) const
+{
+   long cur = FindOffset(offset);
+   long target = FindSerial(serial_number);
+
+   int num_skip = 0;
+   if (target > cur)
+      num_skip = CountData(target) - CountData(cur);
+
+   return Skip(offset, num_skip, skipped);
+}
+
+void TMEventIndex::FindRunBoundaries(std::vector<long>* bor, std::vector<long>* eor) const
+{
+   for (unsigned i=0; i<fSpecial.size(); i++) {
+      const TMIndexEntry& e = fEntries[fSpecial[i]];
+      if (e.event_id == 0x8000)
+         bor->push_back(fSpecial[i]);
+      else if (e.event_id == 0x8001)
+         eor->push_back(fSpecial[i]);
+   }
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,201 @@
+// midasmmap.cxx
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "midasmmap.h"
+
+// bank header flags, see midas.h
+
+#define BANK_FORMAT_32BIT   (1<<4)
+#define BANK_FORMAT_64BIT_ALIGNED (1<<5)
+
+TMEventView::TMEventView() // ctor
+{
+   event_id = 0;
+   trigger_mask = 0;
+   serial_number = 0;
+   time_stamp = 0;
+   data_size = 0;
+   bank_header_flags = 0;
+   header = NULL;
+   offset = 0;
+}
+
+bool TMEventView::Parse(const char* ptr, size_t size)
+{
+   if (size < TMEVENT_HEADER_SIZE)
+      return false;
+
+   header = ptr;
+
+   memcpy(&event_id,      ptr + 0,  2);
+   memcpy(&trigger_mask,  ptr + 2,  2);
+   memcpy(&serial_number, ptr + 4,  4);
+   memcpy(&time_stamp,    ptr + 8,  4);
+   memcpy(&data_size,     ptr + 12, 4);
+
+   if (data_size > size - TMEVENT_HEADER_SIZE)
+      return false;
+
+   bank_header_flags = 0;
+   if (data_size >= 8)
+      memcpy(&bank_header_flags, ptr + TMEVENT_HEADER_SIZE + 4, 4);
+
+   return true;
+}
+
+bool TMEventView::FindBank(const char* name, TMBank* bank) const
+{
+   if (data_size < 8)
+      return false;
+
+   uint32_t all_banks_size = 0;
+   memcpy(&all_banks_size, GetEventData(), 4);
+
+   size_t pos = TMEVENT_HEADER_SIZE + 8;
+   size_t end = TMEVENT_HEADER_SIZE + 8 + all_banks_size;
+
+   if (end > GetSize())
+      end = GetSize();
+
+   size_t bank_header_size = 8;
+   if (bank_header_flags & BANK_FORMAT_64BIT_ALIGNED)
+      bank_header_size = 16;
+   else if (bank_header_flags & BANK_FORMAT_32BIT)
+      bank_header_size = 12;
+
+   while (pos + bank_header_size <= end) {
+      const char* p = header + pos;
+
+      uint32_t type = 0;
+      uint32_t size = 0;
+
+      if (bank_header_size == 8) {
+         uint16_t type16 = 0;
+         uint16_t size16 = 0;
+         memcpy(&type16, p + 4, 2);
+         memcpy(&size16, p + 6, 2);
+         type = type16;
+         size = size16;
+      } else {
+         memcpy(&type, p + 4, 4);
+         memcpy(&size, p + 8, 4);
+      }
+
+      size_t data_offset = pos + bank_header_size;
+
+      if (data_offset + size > end) // truncated bank
+         return false;
+
+      if (memcmp(p, name, 4) == 0) {
+         bank->name.assign(p, 4);
+         bank->type = type;
+         bank->data_size = size;
+         bank->data_offset = data_offset;
+         return true;
+      }
+
+      pos = data_offset + ((size + 7) & ~7);
+   }
+
+   return false;
+}
+
+TMEvent* TMEventView::NewEvent() const
+{
+   return new TMEvent(header, GetSize());
+}
+
+TMMappedFile::TMMappedFile(const char* filename) // ctor
+{
+   fFilename = filename;
+   fError = false;
+   fData = NULL;
+   fSize = 0;
+   fPos = 0;
+
+   int fd = open(filename, O_RDONLY);
+   if (fd < 0) {
+      fError = true;
+      fErrorString = strerror(errno);
+      return;
+   }
+
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      fError = true;
+      fErrorString = strerror(errno);
+      close(fd);
+      return;
+   }
+
+   fSize = st.st_size;
+
+   if (fSize > 0) {
+      void* ptr = mmap(NULL, fSize, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED) {
+         fError = true;
+         fErrorString = strerror(errno);
+         fSize = 0;
+      } else {
+         fData = (const char*)ptr;
+         madvise(ptr, fSize, MADV_SEQUENTIAL);
+      }
+   }
+
+   close(fd);
+}
+
+TMMappedFile::~TMMappedFile() // dtor
+{
+   if (fData) {
+      munmap((void*)fData, fSize);
+      fData = NULL;
+   }
+   fSize = 0;
+}
+
+bool TMMappedFile::ReadEvent(TMEventView* view)
+{
+   if (fError || fPos >= fSize)
+      return false;
+
+   if (!view->Parse(fData + fPos, fSize - fPos)) {
+      fprintf(stderr, "TMMappedFile::ReadEvent: truncated event at offset %lu in \"%s\"\n", (unsigned long)fPos, fFilename.c_str());
+      fPos = fSize;
+      return false;
+   }
+
+   view->offset = fPos;
+   fPos += view->GetSize();
+
+   return true;
+}
+
+bool TMMappedFile::CanMap(const char* filename)
+{
+   size_t len = strlen(filename);
+   if (len < 4 || strcmp(filename + len - 4, ".mid") != 0)
+      return false;
+
+   struct stat st;
+   if (stat(filename, &st) != 0)
+      return false;
+
+   return S_ISREG(st.st_mode);
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,294 @@
+// tahist.cxx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <mutex>
+#include <algorithm>
+
+#include "tahist.h"
+
+// all histograms, for FlushAll()
+
+static std::mutex& RegistryMutex()
+{
+   static std::mutex m;
+   return m;
+}
+
+static std::vector<TAHistogram*>& Registry()
+{
+   static std::vector<TAHistogram*> v;
+   return v;
+}
+
+// shard indices are given to threads on first use and returned
+// when the thread exits, the --mt pipeline starts new threads for every run.
+// Shards stay with the histogram, the next thread with the same index adds to them.
+
+static std::vector<int> gFreeThreadIndex;
+static int gNextThreadIndex = 0;
+
+struct TAHistThreadIndex
+{
+   int fIndex = -1;
+
+   ~TAHistThreadIndex() // dtor, at thread exit
+   {
+      if (fIndex < 0)
+         return;
+      std::lock_guard<std::mutex> lock(RegistryMutex());
+      gFreeThreadIndex.push_back(fIndex);
+   }
+};
+
+int TAHistogram::ThreadIndex()
+{
+   static thread_local TAHistThreadIndex t;
+   if (t.fIndex >= 0)
+      return t.fIndex;
+
+   std::lock_guard<std::mutex> lock(RegistryMutex());
+   if (!gFreeThreadIndex.empty()) {
+      t.fIndex = gFreeThreadIndex.back();
+      gFreeThreadIndex.pop_back();
+   } else {
+      t.fIndex = gNextThreadIndex++;
+   }
+
+   if (t.fIndex >= TAHIST_MAX_THREADS) {
+      fprintf(stderr, "TAHistogram::ThreadIndex: more than %d threads fill histograms, increase TAHIST_MAX_THREADS\n", TAHIST_MAX_THREADS);
+      abort();
+   }
+
+   return t.fIndex;
+}
+
+void TAHistAxis::Set(const TAxis* axis)
+{
+   fNbins = axis->GetNbins();
+   fXmin = axis->GetXmin();
+   fXmax = axis->GetXmax();
+   fScale = (fXmax > fXmin) ? fNbins/(fXmax - fXmin) : 0;
+   fAxis = axis->IsVariableBinSize() ? axis : NULL;
+}
+
+TAHistogram::TAHistogram() // ctor
+{
+   fHist = NULL;
+   fNcells = 0;
+   fNstats = 0;
+   fSumw2 = false;
+   fCounts = false;
+   for (int i=0; i<TAHIST_MAX_THREADS; i++)
+      fShards[i] = NULL;
+}
+
+TAHistogram::~TAHistogram() // dtor
+{
+   Attach(NULL, 0, 0);
+}
+
+void TAHistogram::Attach(TH1* h, int ncells, int nstats, bool counts)
+{
+   {
+      std::lock_guard<std::mutex> lock(RegistryMutex());
+      std::vector<TAHistogram*>& r = Registry();
+      if (fHist && !h)
+         r.erase(std::remove(r.begin(), r.end(), this), r.end());
+      else if (!fHist && h)
+         r.push_back(this);
+   }
+
+   DeleteShards();
+
+   fHist = h;
+   fNcells = ncells;
+   fNstats = nstats;
+   fSumw2 = h && h->GetSumw2N() > 0;
+   fCounts = counts;
+}
+
+TAHistogram::Shard* TAHistogram::NewShard(int thread)
+{
+   assert(fHist != NULL);
+
+   Shard* s = new Shard;
+   if (fCounts) {
+      s->fCounts.resize(fNcells, 0);
+   } else {
+      s->fBins.resize(fNcells, 0);
+      if (fSumw2)
+         s->fSumw2.resize(fNcells, 0);
+   }
+   for (int i=0; i<7; i++)
+      s->fStats[i] = 0;
+   s->fEntries = 0;
+   s->fSumX = 0;
+   s->fSumX2 = 0;
+
+   fShards[thread].store(s, std::memory_order_release);
+   return s;
+}
+
+void TAHistogram::FlushCounts(Shard* s, double* stats)
+{
+   double entries = 0;
+   double inrange = 0;
+
+   for (int bin=0; bin<fNcells; bin++) {
+      uint64_t c = s->fCounts[bin];
+      if (c == 0)
+         continue;
+      fHist->AddBinContent(bin, c);
+      if (fSumw2)
+         fHist->GetSumw2()->fArray[bin] += c;
+      entries += c;
+      if (bin > 0 && bin < fNcells-1)
+         inrange += c;
+      s->fCounts[bin] = 0;
+   }
+
+   if (entries == 0)
+      return;
+
+   // all weights are 1
+   stats[0] += inrange;
+   stats[1] += inrange;
+   stats[2] += s->fSumX;
+   stats[3] += s->fSumX2;
+   s->fSumX = 0;
+   s->fSumX2 = 0;
+
+   fHist->PutStats(stats);
+   fHist->SetEntries(fHist->GetEntries() + entries);
+}
+
+void TAHistogram::DeleteShards()
+{
+   for (int i=0; i<TAHIST_MAX_THREADS; i++) {
+      Shard* s = fShards[i].load(std::memory_order_acquire);
+      if (s) {
+         delete s;
+         fShards[i].store(NULL, std::memory_order_release);
+      }
+   }
+}
+
+void TAHistogram::Flush()
+{
+   if (!fHist)
+      return;
+
+   for (int i=0; i<TAHIST_MAX_THREADS; i++) {
+      Shard* s = fShards[i].load(std::memory_order_acquire);
+      if (!s)
+         continue;
+
+      double stats[7] = { 0 };
+
+      if (fCounts) {
+         fHist->GetStats(stats);
+         FlushCounts(s, stats);
+         continue;
+      }
+
+      if (s->fEntries == 0)
+         continue;
+
+      fHist->GetStats(stats); // before AddBinContent(), GetStats() may compute them from the bins
+
+      double entries = fHist->GetEntries();
+
+      for (int bin=0; bin<fNcells; bin++) {
+         if (s->fBins[bin] != 0) {
+            fHist->AddBinContent(bin, s->fBins[bin]);
+            s->fBins[bin] = 0;
+         }
+      }
+
+      if (fSumw2) {
+         TArrayD* sumw2 = fHist->GetSumw2();
+         for (int bin=0; bin<fNcells; bin++) {
+            sumw2->fArray[bin] += s->fSumw2[bin];
+            s->fSumw2[bin] = 0;
+         }
+      }
+
+      for (int j=0; j<fNstats; j++) {
+         stats[j] += s->fStats[j];
+         s->fStats[j] = 0;
+      }
+
+      fHist->PutStats(stats);
+      fHist->SetEntries(entries + s->fEntries);
+      s->fEntries = 0;
+   }
+}
+
+void TAHistogram::Reset()
+{
+   if (!fHist)
+      return;
+
+   fHist->Reset();
+
+   for (int i=0; i<TAHIST_MAX_THREADS; i++) {
+      Shard* s = fShards[i].load(std::memory_order_acquire);
+      if (!s)
+         continue;
+      std::fill(s->fBins.begin(), s->fBins.end(), 0);
+      std::fill(s->fSumw2.begin(), s->fSumw2.end(), 0);
+      std::fill(s->fCounts.begin(), s->fCounts.end(), 0);
+      s->fSumX = 0;
+      s->fSumX2 = 0;
+      for (int j=0; j<7; j++)
+         s->fStats[j] = 0;
+      s->fEntries = 0;
+   }
+}
+
+void TAHistogram::FlushAll()
+{
+   std::lock_guard<std::mutex> lock(RegistryMutex());
+   std::vector<TAHistogram*>& r = Registry();
+   for (unsigned i=0; i<r.size(); i++)
+      r[i]->Flush();
+}
+
+TAH1D& TAH1D::operator=(TH1D* h)
+{
+   Attach(h, h ? h->GetNbinsX() + 2 : 0, 4);
+   if (h)
+      fX.Set(h->GetXaxis());
+   return *this;
+}
+
+TAH2D& TAH2D::operator=(TH2D* h)
+{
+   Attach(h, h ? (h->GetNbinsX() + 2)*(h->GetNbinsY() + 2) : 0, 7);
+   if (h) {
+      fX.Set(h->GetXaxis());
+      fY.Set(h->GetYaxis());
+   }
+   return *this;
+}
+
+TAH1I& TAH1I::operator=(TH1D* h)
+{
+   Attach(h, h ? h->GetNbinsX() + 2 : 0, 4, true);
+   if (h)
+      fX.Set(h->GetXaxis());
+   return *this;
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,281 @@
+// talog.cxx
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "talog.h"
+
+int      TALog::fgLevel = TALOG_INFO;
+unsigned TALog::fgCategories = 0;
+int      TALog::fgRateLimit = 10;
+size_t   TALog::fgMaxBuffered = 16*1024*1024;
+
+struct TALogRate
+{
+   time_t fSecond = 0; // current one second window
+   int fCount = 0; // messages printed in this window
+   int fSuppressed = 0; // messages dropped since the last printed message
+   std::string fFormat;
+};
+
+// all state is in a function-local static, modules register their
+// categories from static constructors
+
+struct TALogState
+{
+   std::mutex fLock;
+   std::condition_variable fCond;
+   std::condition_variable fFlushed;
+   std::string fBuffer; // waiting for the output thread
+   bool fWriting = false; // output thread is writing a swapped out buffer
+   bool fRunning = false;
+   bool fQuit = false;
+   std::thread* fThread = NULL;
+   int fDropped = 0; // messages dropped because the buffer was full
+   std::unordered_map<const char*, TALogRate> fRate; // keyed by format string
+   std::vector<std::string> fCategoryNames;
+   std::vector<std::string> fEnabledNames;
+};
+
+static TALogState* GetState()
+{
+   static TALogState* s = new TALogState; // never deleted, may be used from static destructors
+   return s;
+}
+
+unsigned TALog::Category(const char* name)
+{
+   TALogState* s = GetState();
+   std::lock_guard<std::mutex> lock(s->fLock);
+
+   for (unsigned i=0; i<s->fCategoryNames.size(); i++)
+      if (s->fCategoryNames[i] == name)
+         return 1u<<i;
+
+   if (s->fCategoryNames.size() >= 32) {
+      fprintf(stderr, "TALog::Category: too many log categories, cannot add \"%s\"\n", name);
+      return 0;
+   }
+
+   unsigned bit = 1u<<s->fCategoryNames.size();
+   s->fCategoryNames.push_back(name);
+
+   for (unsigned i=0; i<s->fEnabledNames.size(); i++)
+      if (s->fEnabledNames[i] == name || s->fEnabledNames[i] == "all")
+         fgCategories |= bit;
+
+   return bit;
+}
+
+void TALog::EnableCategory(const char* name)
+{
+   TALogState* s = GetState();
+   std::lock_guard<std::mutex> lock(s->fLock);
+
+   s->fEnabledNames.push_back(name);
+
+   for (unsigned i=0; i<s->fCategoryNames.size(); i++)
+      if (s->fCategoryNames[i] == name || strcmp(name, "all") == 0)
+         fgCategories |= 1u<<i;
+}
+
+int TALog::ParseLevel(const char* s)
+{
+   if (strcmp(s, "error") == 0)
+      return TALOG_ERROR;
+   if (strcmp(s, "warning") == 0)
+      return TALOG_WARNING;
+   if (strcmp(s, "info") == 0)
+      return TALOG_INFO;
+   if (strcmp(s, "debug") == 0)
+      return TALOG_DEBUG;
+   if (strcmp(s, "trace") == 0)
+      return TALOG_TRACE;
+   char* end = NULL;
+   long v = strtol(s, &end, 0);
+   if (end == s || *end != 0 || v < 0)
+      return -1;
+   return v;
+}
+
+static void AppendSuppressed(std::string* buf, TALogRate* r)
+{
+   char line[256];
+   snprintf(line, sizeof(line), "TALog: suppressed %d more messages like \"%.100s\"\n", r->fSuppressed, r->fFormat.c_str());
+   buf->append(line);
+   r->fSuppressed = 0;
+}
+
+void TALog::Print(int level, unsigned category, const char* format, ...)
+{
+   char line[1024];
+
+   va_list ap;
+   va_start(ap, format);
+   int len = vsnprintf(line, sizeof(line), format, ap);
+   va_end(ap);
+
+   if (len < 0)
+      return;
+
+   std::string big; // long messages, i.e. tables
+   const char* msg = line;
+   if (len >= (int)sizeof(line)) {
+      big.resize(len + 1);
+      va_start(ap, format);
+      vsnprintf(&big[0], len + 1, format, ap);
+      va_end(ap);
+      msg = big.data();
+   }
+
+   TALogState* s = GetState();
+   std::unique_lock<std::mutex> lock(s->fLock);
+
+   if (fgRateLimit > 0) {
+      time_t now = time(NULL);
+      TALogRate* r = &s->fRate[format];
+      if (r->fSecond != now) {
+         r->fSecond = now;
+         r->fCount = 0;
+      }
+      if (r->fCount >= fgRateLimit) {
+         if (r->fSuppressed == 0) {
+            r->fFormat = format;
+            while (!r->fFormat.empty() && r->fFormat.back() == '\n')
+               r->fFormat.pop_back();
+         }
+         r->fSuppressed++;
+         return;
+      }
+      r->fCount++;
+      if (r->fSuppressed > 0)
+         AppendSuppressed(&s->fBuffer, r);
+   }
+
+   if (!s->fRunning) {
+      // no output thread yet, write directly
+      std::string buf;
+      buf.swap(s->fBuffer);
+      buf.append(msg, len);
+      lock.unlock();
+      fwrite(buf.data(), 1, buf.size(), stdout);
+      return;
+   }
+
+   if (s->fBuffer.size() + len > fgMaxBuffered) {
+      s->fDropped++;
+      return;
+   }
+
+   bool wakeup = s->fBuffer.empty();
+   s->fBuffer.append(msg, len);
+   lock.unlock();
+
+   if (wakeup)
+      s->fCond.notify_one();
+}
+
+static void LogThread(TALogState* s)
+{
+   std::string buf;
+   std::unique_lock<std::mutex> lock(s->fLock);
+   while (1) {
+      while (s->fBuffer.empty() && !s->fQuit)
+         s->fCond.wait(lock);
+
+      if (s->fBuffer.empty() && s->fQuit)
+         break;
+
+      buf.swap(s->fBuffer);
+      s->fWriting = true;
+      lock.unlock();
+
+      fwrite(buf.data(), 1, buf.size(), stdout);
+      fflush(stdout);
+      buf.clear();
+
+      lock.lock();
+      s->fWriting = false;
+      s->fFlushed.notify_all();
+   }
+   s->fFlushed.notify_all();
+}
+
+void TALog::Start()
+{
+   TALogState* s = GetState();
+   std::lock_guard<std::mutex> lock(s->fLock);
+   if (s->fRunning)
+      return;
+   s->fQuit = false;
+   s->fRunning = true;
+   s->fThread = new std::thread(LogThread, s);
+}
+
+void TALog::Flush()
+{
+   TALogState* s = GetState();
+   std::unique_lock<std::mutex> lock(s->fLock);
+   while (s->fRunning && (!s->fBuffer.empty() || s->fWriting))
+      s->fFlushed.wait(lock);
+}
+
+void TALog::Stop()
+{
+   TALogState* s = GetState();
+   std::thread* t = NULL;
+
+   {
+      std::lock_guard<std::mutex> lock(s->fLock);
+
+      for (auto& it : s->fRate)
+         if (it.second.fSuppressed > 0)
+            AppendSuppressed(&s->fBuffer, &it.second);
+
+      if (s->fDropped > 0) {
+         char line[256];
+         snprintf(line, sizeof(line), "TALog: dropped %d messages, output was too slow\n", s->fDropped);
+         s->fBuffer.append(line);
+         s->fDropped = 0;
+      }
+
+      t = s->fThread;
+      s->fThread = NULL;
+      s->fQuit = true;
+   }
+
+   s->fCond.notify_one();
+
+   if (t) {
+      t->join();
+      delete t;
+   } else {
+      // output thread was never started
+      std::lock_guard<std::mutex> lock(s->fLock);
+      fwrite(s->fBuffer.data(), 1, s->fBuffer.size(), stdout);
+      s->fBuffer.clear();
+   }
+
+   std::lock_guard<std::mutex> lock(s->fLock);
+   s->fRunning = false;
+   fflush(stdout);
+}
+
+//end
+/* emacs
+ * Local Variables:
+ * tab-width: 8
+ * c-basic-offset: 3
+ * indent-tabs-mode: nil
+ * End:
+ */